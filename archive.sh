@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Update of a static library.
+#
+# Usage: archive.sh ARCHIVE OBJECTS...
+#
+# UPDATED environment variable lists objects changed since the archive
+#   was updated last time (see STATIC_LIBRARY in prologue.mk).
+# If it's set and the archive is there, only these members are replaced.
+# Otherwise, the archive is created anew out of all the objects,
+#   so that members of removed objects don't stay there.
+#
+# The archive is thin ('T'): it records paths of its' members, which stay
+#   where they were compiled, and the index of their' symbols. So it's
+#   small, and rewriting it doesn't copy any object. Its' bytes don't
+#   change when code of a member does, though: programs watch the objects
+#   themselves (see STATIC_LIBRARY in prologue.mk).
+# 'D' makes the archive deterministic: timestamps, owners and modes of
+#   members are zeroed. So the archive is the same when its' members are.
+
+ARCHIVE=$1
+shift 1
+
+if [ -n "$UPDATED" ] && [ -f "$ARCHIVE" ]
+then
+    exec ar rcsDT "$ARCHIVE" $UPDATED
+fi
+
+rm -f "$ARCHIVE"
+exec ar rcsDT "$ARCHIVE" "$@"
@@ -0,0 +1,336 @@
+#!/bin/sh
+
+# Content-addressed cache of build results.
+#
+# Usage: cache.sh [--cache-dir DIR] [--fingerprint FILE] [--preprocess]
+#                 -- COMMAND...
+#
+# The command is wrapped: if a command with the same inputs was run before
+#   (in this build directory or any other one - another worktree,
+#   another clone, or the same one after 'rm -rf build'), its' outputs are
+#   restored from the cache instead of running the command.
+#
+# Outputs are taken from the command line: arguments of '-o' and '-MF'.
+#
+# The cache key is a hash of:
+#   - the command itself;
+#   - with --preprocess: output of the preprocessor for the same command.
+#     That covers the source, all the headers it includes and the macros
+#     (including predefined ones, which tell the compiler version);
+#   - without it: contents of every file named on the command line,
+#     which isn't an output, and of the libraries given with -l,
+#     found the way the linker finds them: in -L directories first,
+#     then where the compiler looks. With 'gcc --version', that's what
+#     linking of objects depends on, save for the C library.
+#
+# Results are stored under DIR/<first two characters of key>/<key>/:
+#   outputs in files named by their' position on the command line,
+#   and whatever the command wrote to stderr (to show warnings again).
+#
+# With --fingerprint, the command isn't run at all if the source it compiles
+#   has the same tokens as last time: comments, blank lines and spacing
+#   don't matter. The fingerprint - hash of the command and
+#   the preprocessed source reduced to tokens (see tokens.awk) - is kept in
+#   FILE, next to the object. When it's the same, outputs are only touched,
+#   so that Make sees them up to date. That's done before looking into
+#   the cache, and works without it too.
+# When debugging info is requested (-g), line markers are kept:
+#   positions of code end up in the object then.
+
+while [ $# -gt 0 ]
+do
+    case $1 in
+        --cache-dir)
+            CACHE_DIR=$2
+            shift 2
+            ;;
+        --preprocess)
+            PREPROCESS=True
+            shift 1
+            ;;
+        --fingerprint)
+            FINGERPRINT_FILE=$2
+            shift 2
+            ;;
+        --)
+            shift 1
+            break
+            ;;
+        *)
+            break
+            ;;
+    esac
+done
+
+if [ -z "$CACHE_DIR" ] && [ -z "$FINGERPRINT_FILE" ]
+then
+    exec "$@"
+fi
+
+# tokens.awk is next to us.
+QAKE_DIR=$(dirname "$0")
+
+if command -v md5sum > /dev/null
+then
+    HASH=md5sum
+else
+    HASH='md5 -q'
+fi
+
+OUTPUTS=
+PREV=
+for ARG in "$@"
+do
+    case $PREV in
+        -o | -MF)
+            OUTPUTS="$OUTPUTS $ARG"
+            ;;
+    esac
+    PREV=$ARG
+done
+
+# Run the same compiler command, but only preprocess.
+# Options producing outputs are dropped, except the dependency file
+#   if KEEP_DEPENDENCIES is set.
+# -dD keeps macro definitions in the output, including predefined ones.
+# PREPROCESS_FLAGS are added to the command.
+# 'for' iterates over the original arguments, while we shift them out
+#   and append the ones we keep.
+preprocess() {
+    SKIP=
+    for ARG
+    do
+        shift 1
+        if [ -n "$SKIP" ]
+        then
+            SKIP=
+            continue
+        fi
+        case $ARG in
+            -MF | -MT | -MQ)
+                if [ -n "$KEEP_DEPENDENCIES" ]
+                then
+                    set -- "$@" "$ARG"
+                else
+                    SKIP=True
+                fi
+                ;;
+            -MD | -MMD | -MP)
+                [ -z "$KEEP_DEPENDENCIES" ] || set -- "$@" "$ARG"
+                ;;
+            -o)
+                SKIP=True
+                ;;
+            -c)
+                ;;
+            *)
+                set -- "$@" "$ARG"
+                ;;
+        esac
+    done
+    "$@" -E -dD $PREPROCESS_FLAGS
+}
+
+has_debug_info() {
+    for ARG
+    do
+        case $ARG in
+            -g0)
+                ;;
+            -g*)
+                return 0
+                ;;
+        esac
+    done
+    return 1
+}
+
+# The dependency file is written by this run: when the outputs are only
+#   touched, it still lists headers where they're found now.
+fingerprint_input() {
+    echo "$@"
+    if has_debug_info "$@"
+    then
+        KEEP_DEPENDENCIES=y preprocess "$@"
+    else
+        KEEP_DEPENDENCIES=y PREPROCESS_FLAGS=-P preprocess "$@" \
+            | awk -f "$QAKE_DIR/tokens.awk"
+    fi
+}
+
+# Run the command, recording the fingerprint if it succeeds.
+run() {
+    "$@" || return
+    [ -z "$FINGERPRINT_FILE" ] || echo "$FINGERPRINT" > "$FINGERPRINT_FILE"
+}
+
+outputs_exist() {
+    for OUTPUT in $OUTPUTS
+    do
+        [ -f "$OUTPUT" ] || return 1
+    done
+}
+
+is_output() {
+    for OUTPUT in $OUTPUTS
+    do
+        [ "$OUTPUT" = "$1" ] && return 0
+    done
+    return 1
+}
+
+# Directories given with -L, wherever they are on the command line:
+#   the linker applies them to all -l options.
+library_directories() {
+    PREV=
+    for ARG
+    do
+        case $PREV in
+            -L)
+                echo "$ARG"
+                ;;
+        esac
+        case $ARG in
+            -L?*)
+                echo "${ARG#-L}"
+                ;;
+        esac
+        PREV=$ARG
+    done
+}
+
+# Name and contents of the library of -l$1, shared and static one
+#   (-static picks the latter). -l:FILE names the file itself.
+# $COMPILER tells where it looks, when -L directories don't have it:
+#   -print-file-name prints the name as is when it doesn't find it.
+library_input() {
+    case $1 in
+        :*)
+            NAMES=${1#:}
+            ;;
+        *)
+            NAMES="lib$1.so lib$1.a"
+            ;;
+    esac
+    for NAME in $NAMES
+    do
+        FILE=
+        for DIR in $LIBRARY_DIRECTORIES
+        do
+            if [ -f "$DIR/$NAME" ]
+            then
+                FILE=$DIR/$NAME
+                break
+            fi
+        done
+        [ -n "$FILE" ] || FILE=$("$COMPILER" -print-file-name="$NAME")
+        if [ "$FILE" != "$NAME" ] && [ -f "$FILE" ]
+        then
+            echo "$FILE"
+            cat "$FILE"
+        fi
+    done
+}
+
+key_input() {
+    echo "$@"
+    if [ -n "$PREPROCESS" ]
+    then
+        preprocess "$@"
+    else
+        COMPILER=$1
+        "$COMPILER" --version
+        LIBRARY_DIRECTORIES=$(library_directories "$@")
+        PREV=
+        for ARG in "$@"
+        do
+            if [ "$PREV" = -l ]
+            then
+                library_input "$ARG"
+            fi
+            case $ARG in
+                -l?*)
+                    library_input "${ARG#-l}"
+                    ;;
+            esac
+            if [ -f "$ARG" ] && ! is_output "$ARG"
+            then
+                echo "$ARG"
+                cat "$ARG"
+            fi
+            PREV=$ARG
+        done
+    fi
+}
+
+if [ -n "$FINGERPRINT_FILE" ]
+then
+    read -r FINGERPRINT REST <<EOF
+$(fingerprint_input "$@" 2>/dev/null | $HASH)
+EOF
+    if [ -f "$FINGERPRINT_FILE" ] \
+       && read -r RECORDED < "$FINGERPRINT_FILE" \
+       && [ "$FINGERPRINT" = "$RECORDED" ] \
+       && outputs_exist
+    then
+        touch $OUTPUTS
+        exit 0
+    fi
+    # Outputs are about to change: if we're interrupted,
+    #   they mustn't be taken for the ones matching the fingerprint.
+    rm -f "$FINGERPRINT_FILE"
+fi
+
+if [ -z "$CACHE_DIR" ]
+then
+    run "$@"
+    exit
+fi
+
+# If preprocessing fails, the key is computed over whatever we've got.
+# That's harmless: the command will fail the same way, and failed
+#   results are never stored.
+read -r KEY REST <<EOF
+$(key_input "$@" 2>/dev/null | $HASH)
+EOF
+
+ENTRY="$CACHE_DIR/${KEY%${KEY#??}}/$KEY"
+
+if [ -d "$ENTRY" ]
+then
+    I=0
+    for OUTPUT in $OUTPUTS
+    do
+        cp "$ENTRY/$I" "$OUTPUT" || { run "$@"; exit; }
+        I=$((I + 1))
+    done
+    [ -f "$ENTRY/stderr" ] && cat "$ENTRY/stderr" >&2
+    run true
+    exit
+fi
+
+mkdir -p "$CACHE_DIR"
+TMP=$(mktemp -d "$CACHE_DIR/tmp.XXXXXX") || { run "$@"; exit; }
+
+run "$@" 2> "$TMP/stderr"
+STATUS=$?
+cat "$TMP/stderr" >&2
+
+if [ $STATUS -eq 0 ]
+then
+    I=0
+    for OUTPUT in $OUTPUTS
+    do
+        cp "$OUTPUT" "$TMP/$I" || break
+        I=$((I + 1))
+    done
+    # Another build may have stored the same entry meanwhile -
+    #   then ours is just dropped.
+    mkdir -p "$(dirname "$ENTRY")"
+    if [ ! -d "$ENTRY" ] && mv "$TMP" "$ENTRY" 2> /dev/null
+    then
+        TMP=
+    fi
+fi
+[ -n "$TMP" ] && rm -rf "$TMP"
+exit $STATUS
@@ -0,0 +1,189 @@
+# Critical path of the build: what bounds it, however many cores there are.
+#
+# Usage: make -pq ... | awk -f critical-path.awk -v CORES=N \
+#            [-v HISTORY=DURATIONS] TRACE -
+#
+# This is what 'qake --critical-path' runs.
+# TRACE is the build timeline (see native/relay.c): it gives duration
+#   of each target built by the last build. Targets without events
+#   (sources, headers, markers updated by the native module) weigh nothing.
+# The timeline is started anew by each build, so after a null build it has
+#   no events. Then durations come from HISTORY instead (see durations.awk):
+#   the last build merged the timeline before it into there.
+# Standard input is Make's database: it gives the graph, with
+#   the prerequisites found by pattern rules and the included .d files.
+#   Order-only prerequisites count too: they're waited for all the same.
+#
+# The report has:
+#   - the longest weighted chain of targets, and its' length (the span);
+#   - total work: sum of all durations;
+#   - upper bound of speedup at N cores: work / max(work / N, span).
+#     Make can't do better than that, whatever the order of jobs;
+#   - targets of the chain, ordered by how much the span shrinks
+#     if the target took no time at all. Other chains may become
+#     the longest one, so that's less than duration of the target.
+#
+# Durations are wall-clock, so they're only as good as the last build:
+#   the numbers of a heavily loaded machine, or an incremental build
+#   which only rebuilt a couple of targets, won't tell much.
+
+BEGIN {
+    if (CORES == "")
+        CORES = 1
+}
+
+# Unescape JSON string contents, the way relay.c escapes them.
+function unescape(s,    out, c) {
+    out = ""
+    while (match(s, /\\/)) {
+        out = out substr(s, 1, RSTART - 1)
+        c = substr(s, RSTART + 1, 1)
+        if (c == "u") {
+            out = out sprintf("%c", ("0x" substr(s, RSTART + 2, 4)) + 0)
+            s = substr(s, RSTART + 6)
+        } else {
+            out = out c
+            s = substr(s, RSTART + 2)
+        }
+    }
+    return out s
+}
+
+# Events of the timeline: one per line.
+FNR == NR {
+    if (!match($0, /"name":"([^"\\]|\\.)*"/))
+        next
+    name = unescape(substr($0, RSTART + 8, RLENGTH - 9))
+    if (!match($0, /"dur":[0-9]+/))
+        next
+    WEIGHT[name] += substr($0, RSTART + 6, RLENGTH - 6)
+    next
+}
+
+# Files section of the database: 'target: prerequisites | order-only'.
+/^# Files/ { IN_FILES = 1; next }
+/^# (VPATH|files hash-table)/ { IN_FILES = 0; next }
+
+IN_FILES && /^[^#\t %][^=]*:( |$)/ && !/^[^ ]*:[:!?+]?=/ {
+    target = substr($0, 1, index($0, ":") - 1)
+    n = split(substr($0, index($0, ":") + 1), words, " ")
+    for (i = 1; i <= n; i++)
+        if (words[i] != "|")
+            PREREQUISITES[target] = PREREQUISITES[target] " " words[i]
+    TARGETS[target] = 1
+}
+
+# Longest chain ending with the target, the target included.
+# The chain itself is kept as a list of links: NEXT[t] is the prerequisite
+#   the chain of t continues with.
+function longest(t,    n, i, p, best, d, prerequisites) {
+    if (t in LONGEST)
+        return LONGEST[t]
+    # Make drops circular dependencies, and so do we.
+    LONGEST[t] = 0
+    best = 0
+    NEXT[t] = ""
+    n = split(PREREQUISITES[t], prerequisites, " ")
+    for (i = 1; i <= n; i++) {
+        p = prerequisites[i]
+        d = longest(p)
+        if (d > best) {
+            best = d
+            NEXT[t] = p
+        }
+    }
+    LONGEST[t] = best + (t == SKIPPED ? 0 : WEIGHT[t])
+    return LONGEST[t]
+}
+
+# Length of the longest chain of the whole graph, and its' last target.
+function span(    t, d, best) {
+    split("", LONGEST)
+    split("", NEXT)
+    best = 0
+    LAST = ""
+    for (t in TARGETS) {
+        d = longest(t)
+        if (d > best) {
+            best = d
+            LAST = t
+        }
+    }
+    for (t in WEIGHT)
+        if (!(t in TARGETS) && longest(t) > best) {
+            best = LONGEST[t]
+            LAST = t
+        }
+    return best
+}
+
+function seconds(us) {
+    return sprintf("%.3f s", us / 1000000)
+}
+
+# Durations recorded before: us:655000 build/res/circled/ircq.c.o
+function read_history(    line, fields) {
+    while ((getline line < HISTORY) > 0)
+        if (split(line, fields, " ") == 2 && fields[1] ~ /^us:[0-9]+$/)
+            WEIGHT[fields[2]] = substr(fields[1], 4) + 0
+    close(HISTORY)
+}
+
+END {
+    work = 0
+    for (t in WEIGHT)
+        work += WEIGHT[t]
+    if (work == 0 && HISTORY != "") {
+        read_history()
+        FROM_HISTORY = 1
+    }
+    work = 0
+    for (t in WEIGHT) {
+        work += WEIGHT[t]
+        recorded++
+    }
+    if (work == 0) {
+        print "No durations recorded: build the project first." > "/dev/stderr"
+        exit 1
+    }
+
+    SKIPPED = ""
+    total = span()
+    links = 0
+    for (t = LAST; t != ""; t = NEXT[t])
+        if (WEIGHT[t] > 0)
+            chain[++links] = t
+
+    if (FROM_HISTORY)
+        print "The last build ran nothing: durations are from the history.\n"
+    printf "Critical path: %s\n", seconds(total)
+    for (i = links; i >= 1; i--)
+        printf "  %10s  %s\n", seconds(WEIGHT[chain[i]]), chain[i]
+    printf "\nTotal work: %s in %d targets\n", seconds(work), recorded
+
+    printf "\nSpeedup at most:\n"
+    for (cores = 1; cores < CORES; cores *= 2)
+        printf "  %4d cores: %.2fx\n", cores, \
+            work / (work / cores > total ? work / cores : total)
+    printf "  %4d cores: %.2fx\n", CORES, \
+        work / (work / CORES > total ? work / CORES : total)
+    printf "  unlimited:  %.2fx\n", work / total
+
+    # The span without each target of the chain in turn.
+    for (i = 1; i <= links; i++) {
+        SKIPPED = chain[i]
+        gain[i] = total - span()
+    }
+    printf "\nShortening these helps most:\n"
+    for (shown = 0; shown < links && shown < 10; shown++) {
+        best = 0
+        for (i = 1; i <= links; i++)
+            if (!(i in done) && (best == 0 || gain[i] > gain[best]))
+                best = i
+        done[best] = 1
+        if (gain[best] <= 0)
+            break
+        printf "  %10s of %10s  %s\n", \
+            seconds(gain[best]), seconds(WEIGHT[chain[best]]), chain[best]
+    }
+}
@@ -0,0 +1,40 @@
+# Merge durations from the build timeline into the history of durations.
+#
+# Usage: awk -f durations.awk [HISTORY] TRACE > NEW_HISTORY
+#
+# prologue.mk runs this before the timeline of the last build is started
+#   anew, and uses the history to start the slowest targets first
+#   (see SLOWEST_FIRST there).
+#
+# The history has one target per line, slowest first:
+#   us:655000 build/res/circled/ircq.c.o
+# The prefix is there so that Make can drop durations
+#   with $(filter-out us:%,...), keeping just the targets in order.
+#
+# A target built again gets the average of recorded and new duration:
+#   one build on a busy machine shouldn't reorder everything.
+# Targets not built by the last build keep what they had.
+
+# Durations recorded before.
+/^us:[0-9]+ / {
+    DURATION[$2] = substr($1, 4) + 0
+    next
+}
+
+# Events of the timeline: one per line, see native/relay.c.
+match($0, /"name":"[^"\\ ]*"/) {
+    name = substr($0, RSTART + 8, RLENGTH - 9)
+    if (!match($0, /"dur":[0-9]+/))
+        next
+    duration = substr($0, RSTART + 6, RLENGTH - 6) + 0
+    if (name in DURATION)
+        duration = int((DURATION[name] + duration) / 2)
+    DURATION[name] = duration
+}
+
+END {
+    sort = "sort -t: -k2,2nr"
+    for (name in DURATION)
+        print "us:" DURATION[name], name | sort
+    close(sort)
+}
@@ -108,6 +108,15 @@ maybe_install_make() {
     fi
 }
 
+build_native() {
+    # Native helpers are optional: qake works without them, only slower.
+    info "Building native helpers in $QAKE_INSTALL_DIR/native"
+    if ! ${MAKE:-make} -C "$QAKE_INSTALL_DIR/native" > /dev/null
+    then
+        info "Native helpers weren't built, falling back to shell implementation."
+    fi
+}
+
 maybe_install_env() {
     if $INSTALL_ENV
     then
@@ -135,6 +144,7 @@ parse_arguments $*
 [ ! -d $QAKE_INSTALL_DIR ] && mkdir -p $QAKE_INSTALL_DIR
 maybe_clone
 maybe_install_make
+build_native
 maybe_install_env
 
 congrats "Qake is successfully installed and is ready to work!"
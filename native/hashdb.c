@@ -0,0 +1,452 @@
+/*
+ * Persistent store of hashes of tracked files.
+ *
+ * Without it, each tracked file has three auxiliary files:
+ *   %.hash.new, %.hash.old and %.did_update,
+ *   and 'diff' and 'cp' are spawned on each check.
+ * With it, there's one file per build directory holding digests and
+ *   stat tuples of all tracked files, and only %.did_update markers
+ *   are left on disk - Make needs their timestamps.
+ *
+ * The store is read once per Make process, by mapping the file to memory.
+ * Changes are kept in memory and written back when Make exits.
+ *
+ * Crash safety:
+ *   The file is never modified in place. New contents are written to
+ *   a temporary file, synced to disk and renamed over the old one,
+ *   so there's either old or new store, never a half-written one.
+ *   There's also a checksum at the end: a store that doesn't match it
+ *   is ignored, as if it wasn't there.
+ *   Losing the store is safe: all digests will differ from (absent) recorded
+ *   ones, all markers will be touched, and everything gets rebuilt.
+ *   Same goes for Make killed before writing the store: markers are touched
+ *   before new digests are recorded, so we can only rebuild too much,
+ *   never too little.
+ *
+ * Several Make processes may work with the same store (recursive Make,
+ *   or just two builds at once). Each one locks the store while writing and
+ *   merges its' own changes into what's on disk at that moment.
+ *
+ * Layout of the file (native byte order - it never leaves the machine):
+ *   header: magic, number of records;
+ *   records: struct disk_record followed by the key, padded to 8 bytes;
+ *   trailer: XXH64 of everything above.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qake.h"
+
+static const char magic[8] = "QAKEDB1";
+
+struct disk_header
+{
+  char magic[8];
+  uint64_t count;
+};
+
+struct disk_record
+{
+  struct hashdb_record record;
+  uint32_t key_length;
+  uint32_t reserved;
+};
+
+struct entry
+{
+  char *key;
+  uint64_t key_hash;
+  struct hashdb_record record;
+  /* Changed by this process, so it must be written back. */
+  int dirty;
+};
+
+/* Open addressing hash table with linear probing. */
+struct table
+{
+  struct entry *entries;
+  size_t capacity;
+  size_t count;
+};
+
+struct hashdb
+{
+  char *path;
+  struct table table;
+  int dirty;
+  struct hashdb *next;
+};
+
+/* All stores opened by this process, to write them back at exit. */
+static struct hashdb *opened;
+
+static uint64_t
+key_hash (const char *key)
+{
+  return qake_xxh64 (key, strlen (key), 0);
+}
+
+static struct entry *
+table_find (struct table *table, const char *key, uint64_t hash)
+{
+  size_t i;
+
+  if (table->capacity == 0)
+    return NULL;
+  for (i = hash & (table->capacity - 1);
+       table->entries[i].key != NULL;
+       i = (i + 1) & (table->capacity - 1))
+    if (table->entries[i].key_hash == hash
+        && strcmp (table->entries[i].key, key) == 0)
+      return &table->entries[i];
+  return NULL;
+}
+
+static void table_insert (struct table *table, struct entry *entry);
+
+static void
+table_grow (struct table *table)
+{
+  struct table bigger;
+  size_t i;
+
+  bigger.capacity = table->capacity ? table->capacity * 2 : 1024;
+  bigger.count = 0;
+  bigger.entries = calloc (bigger.capacity, sizeof *bigger.entries);
+  for (i = 0; i < table->capacity; i++)
+    if (table->entries[i].key != NULL)
+      table_insert (&bigger, &table->entries[i]);
+  free (table->entries);
+  *table = bigger;
+}
+
+/* Insert or replace. Takes ownership of the key. */
+static void
+table_insert (struct table *table, struct entry *entry)
+{
+  size_t i;
+
+  if ((table->count + 1) * 10 > table->capacity * 7)
+    table_grow (table);
+
+  for (i = entry->key_hash & (table->capacity - 1);
+       table->entries[i].key != NULL;
+       i = (i + 1) & (table->capacity - 1))
+    if (table->entries[i].key_hash == entry->key_hash
+        && strcmp (table->entries[i].key, entry->key) == 0)
+      {
+        free (table->entries[i].key);
+        table->entries[i] = *entry;
+        return;
+      }
+  table->entries[i] = *entry;
+  table->count++;
+}
+
+static void
+table_free (struct table *table)
+{
+  size_t i;
+
+  for (i = 0; i < table->capacity; i++)
+    free (table->entries[i].key);
+  free (table->entries);
+  table->entries = NULL;
+  table->capacity = table->count = 0;
+}
+
+static size_t
+padded (size_t length)
+{
+  return (length + 7) & ~(size_t) 7;
+}
+
+/* Read the store from disk into the table.
+ * Missing or damaged store leaves the table empty. */
+static void
+load (const char *path, struct table *table)
+{
+  struct stat st;
+  const unsigned char *map;
+  const unsigned char *p;
+  const unsigned char *end;
+  struct disk_header header;
+  uint64_t checksum;
+  uint64_t i;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return;
+  if (fstat (fd, &st) < 0
+      || st.st_size < (off_t) (sizeof header + sizeof checksum))
+    {
+      close (fd);
+      return;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return;
+
+  end = map + st.st_size - sizeof checksum;
+  memcpy (&checksum, end, sizeof checksum);
+  memcpy (&header, map, sizeof header);
+  if (memcmp (header.magic, magic, sizeof magic) != 0
+      || checksum != qake_xxh64 (map, end - map, 0))
+    goto out;
+
+  p = map + sizeof header;
+  for (i = 0; i < header.count; i++)
+    {
+      struct disk_record disk;
+      struct entry entry;
+
+      if (p + sizeof disk > end)
+        break;
+      memcpy (&disk, p, sizeof disk);
+      p += sizeof disk;
+      if (p + disk.key_length > end)
+        break;
+
+      entry.key = strndup ((const char *) p, disk.key_length);
+      entry.key_hash = key_hash (entry.key);
+      entry.record = disk.record;
+      entry.dirty = 0;
+      table_insert (table, &entry);
+      p += padded (disk.key_length);
+    }
+
+ out:
+  munmap ((void *) map, st.st_size);
+}
+
+static int
+write_all (int fd, const void *data, size_t size)
+{
+  const char *p = data;
+
+  while (size > 0)
+    {
+      ssize_t n = write (fd, p, size);
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return -1;
+        }
+      p += n;
+      size -= n;
+    }
+  return 0;
+}
+
+/* Buffered writer computing the checksum as it goes.
+ * The checksum is computed over the whole buffer at the end:
+ *   stores are small enough to be kept in memory. */
+struct buffer
+{
+  char *data;
+  size_t length;
+  size_t capacity;
+};
+
+static void
+append (struct buffer *buffer, const void *data, size_t size)
+{
+  if (buffer->length + size > buffer->capacity)
+    {
+      buffer->capacity = (buffer->length + size) * 2;
+      buffer->data = realloc (buffer->data, buffer->capacity);
+    }
+  memcpy (buffer->data + buffer->length, data, size);
+  buffer->length += size;
+}
+
+static int
+store (const char *path, struct table *table)
+{
+  static const char zeros[8];
+  struct buffer buffer = { NULL, 0, 0 };
+  struct disk_header header;
+  uint64_t checksum;
+  char *temporary;
+  size_t i;
+  int fd;
+  int result = -1;
+
+  memcpy (header.magic, magic, sizeof magic);
+  header.count = table->count;
+  append (&buffer, &header, sizeof header);
+
+  for (i = 0; i < table->capacity; i++)
+    {
+      struct entry *entry = &table->entries[i];
+      struct disk_record disk;
+
+      if (entry->key == NULL)
+        continue;
+      disk.record = entry->record;
+      disk.key_length = strlen (entry->key);
+      disk.reserved = 0;
+      append (&buffer, &disk, sizeof disk);
+      append (&buffer, entry->key, disk.key_length);
+      append (&buffer, zeros, padded (disk.key_length) - disk.key_length);
+    }
+  checksum = qake_xxh64 (buffer.data, buffer.length, 0);
+  append (&buffer, &checksum, sizeof checksum);
+
+  temporary = malloc (strlen (path) + sizeof ".tmp");
+  sprintf (temporary, "%s.tmp", path);
+  fd = open (temporary, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd >= 0)
+    {
+      if (write_all (fd, buffer.data, buffer.length) == 0
+          && fsync (fd) == 0
+          && close (fd) == 0)
+        result = rename (temporary, path);
+      else
+        close (fd);
+      if (result < 0)
+        unlink (temporary);
+    }
+
+  free (temporary);
+  free (buffer.data);
+  return result;
+}
+
+/* Merge our changes into the store on disk and write it back. */
+static void
+save (struct hashdb *db)
+{
+  struct table merged = { NULL, 0, 0 };
+  char *lock_path;
+  size_t i;
+  int lock;
+
+  lock_path = malloc (strlen (db->path) + sizeof ".lock");
+  sprintf (lock_path, "%s.lock", db->path);
+  lock = open (lock_path, O_RDWR | O_CREAT, 0666);
+  if (lock >= 0)
+    flock (lock, LOCK_EX);
+
+  load (db->path, &merged);
+  for (i = 0; i < db->table.capacity; i++)
+    {
+      struct entry entry = db->table.entries[i];
+
+      if (entry.key == NULL || !entry.dirty)
+        continue;
+      entry.key = strdup (entry.key);
+      entry.dirty = 0;
+      table_insert (&merged, &entry);
+    }
+  if (store (db->path, &merged) < 0)
+    fprintf (stderr, "qake: can't write %s: %s\n",
+             db->path, strerror (errno));
+
+  if (lock >= 0)
+    close (lock);
+  free (lock_path);
+  table_free (&merged);
+}
+
+static void
+save_all (void)
+{
+  struct hashdb *db;
+
+  for (db = opened; db != NULL; db = db->next)
+    if (db->dirty)
+      {
+        save (db);
+        db->dirty = 0;
+      }
+}
+
+struct hashdb *
+hashdb_open (const char *path)
+{
+  struct hashdb *db;
+
+  for (db = opened; db != NULL; db = db->next)
+    if (strcmp (db->path, path) == 0)
+      return db;
+
+  if (opened == NULL)
+    atexit (save_all);
+
+  db = calloc (1, sizeof *db);
+  db->path = strdup (path);
+  load (path, &db->table);
+  db->next = opened;
+  opened = db;
+  return db;
+}
+
+const struct hashdb_record *
+hashdb_lookup (struct hashdb *db, const char *key)
+{
+  struct entry *entry = table_find (&db->table, key, key_hash (key));
+
+  return entry ? &entry->record : NULL;
+}
+
+void
+hashdb_store (struct hashdb *db, const char *key,
+              const struct hashdb_record *record)
+{
+  struct entry entry;
+
+  entry.key = strdup (key);
+  entry.key_hash = key_hash (key);
+  entry.record = *record;
+  entry.dirty = 1;
+  table_insert (&db->table, &entry);
+  db->dirty = 1;
+}
+
+/* File timestamps are taken from a coarse clock, so the file can be
+ *   changed again right after we've looked at it, without changing
+ *   the timestamp (or size, if we're unlucky).
+ * Git calls this "racily clean" entries. We do the same as Git:
+ *   stat of a file modified too recently isn't trusted next time. */
+#define RACY_SECONDS 2
+
+void
+hashdb_record_stat (struct hashdb_record *record, const struct stat *st)
+{
+  struct timespec now;
+
+  record->ino = st->st_ino;
+  record->size = st->st_size;
+  record->mtime_sec = st->st_mtim.tv_sec;
+  record->mtime_nsec = st->st_mtim.tv_nsec;
+  record->ctime_sec = st->st_ctim.tv_sec;
+  record->ctime_nsec = st->st_ctim.tv_nsec;
+
+  clock_gettime (CLOCK_REALTIME, &now);
+  record->racy = now.tv_sec - st->st_mtim.tv_sec < RACY_SECONDS
+                 || now.tv_sec - st->st_ctim.tv_sec < RACY_SECONDS;
+}
+
+int
+hashdb_same_stat (const struct hashdb_record *record, const struct stat *st)
+{
+  return !record->racy
+         && record->ino == (uint64_t) st->st_ino
+         && record->size == st->st_size
+         && record->mtime_sec == st->st_mtim.tv_sec
+         && record->mtime_nsec == st->st_mtim.tv_nsec
+         && record->ctime_sec == st->st_ctim.tv_sec
+         && record->ctime_nsec == st->st_ctim.tv_nsec;
+}
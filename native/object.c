@@ -0,0 +1,461 @@
+/*
+ * Hashing of object files and shared libraries by what matters to
+ *   things built out of them.
+ *
+ * Objects, without their debugging info.
+ *   With -g, an object has the line of each instruction recorded in it.
+ *   Adding a comment moves the code below it down, so the object changes
+ *     even though the code in it is the same, and the program is relinked.
+ *   Here, only the sections that make it into the program's code and data
+ *     are hashed, together with symbol tables and relocations for them.
+ *   DWARF sections (.debug_*, compressed .zdebug_*) and relocations
+ *     applying to them are skipped.
+ *   The price: if linking is pruned this way, the program keeps debugging
+ *     info of the previous object, and a debugger may show wrong lines
+ *     until the next meaningful change. That's why it's optional:
+ *     see IGNORE_DEBUG_INFO in prologue.mk.
+ *
+ * Shared libraries, by their ABI.
+ *   A program linked with a shared library only records which symbols
+ *     it takes from which library: the code is loaded at run time.
+ *   So the program needs relinking only when the SONAME or the set of
+ *     exported symbols changes, not when the library does.
+ *   Symbols are hashed by name, type, binding and version index.
+ *     Sizes are hashed only for data: they're part of the ABI there
+ *     (copy relocations), while sizes of functions aren't.
+ *     Addresses are never hashed.
+ *
+ * Only ELF of the host's byte order is understood. Anything else
+ *   is hashed whole, as qake_hash_file does.
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qake.h"
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HOST_DATA ELFDATA2MSB
+#else
+#define HOST_DATA ELFDATA2LSB
+#endif
+
+/* Mapped ELF file and its' section table. */
+struct elf
+{
+  const unsigned char *map;
+  size_t size;
+  int class;
+  uint64_t table;
+  uint64_t entry_size;
+  uint64_t count;
+  uint64_t names;
+};
+
+/* What we need of a section header, for both ELF classes. */
+struct section
+{
+  uint64_t name;
+  uint64_t type;
+  uint64_t flags;
+  uint64_t offset;
+  uint64_t size;
+  uint64_t link;
+  uint64_t info;
+  uint64_t entry_size;
+};
+
+static int
+read_section (const struct elf *elf, uint64_t index, struct section *section)
+{
+  uint64_t offset = elf->table + index * elf->entry_size;
+
+  if (index >= elf->count)
+    return -1;
+  if (elf->class == ELFCLASS64)
+    {
+      Elf64_Shdr shdr;
+
+      if (offset + sizeof shdr > elf->size)
+        return -1;
+      memcpy (&shdr, elf->map + offset, sizeof shdr);
+      section->name = shdr.sh_name;
+      section->type = shdr.sh_type;
+      section->flags = shdr.sh_flags;
+      section->offset = shdr.sh_offset;
+      section->size = shdr.sh_size;
+      section->link = shdr.sh_link;
+      section->info = shdr.sh_info;
+      section->entry_size = shdr.sh_entsize;
+    }
+  else
+    {
+      Elf32_Shdr shdr;
+
+      if (offset + sizeof shdr > elf->size)
+        return -1;
+      memcpy (&shdr, elf->map + offset, sizeof shdr);
+      section->name = shdr.sh_name;
+      section->type = shdr.sh_type;
+      section->flags = shdr.sh_flags;
+      section->offset = shdr.sh_offset;
+      section->size = shdr.sh_size;
+      section->link = shdr.sh_link;
+      section->info = shdr.sh_info;
+      section->entry_size = shdr.sh_entsize;
+    }
+  if (section->type != SHT_NOBITS
+      && section->offset + section->size > elf->size)
+    return -1;
+  return 0;
+}
+
+/* Read the ELF header. Returns -1 if the file isn't what we understand. */
+static int
+read_elf (const unsigned char *map, size_t size, struct elf *elf)
+{
+  if (size < EI_NIDENT || memcmp (map, ELFMAG, SELFMAG) != 0
+      || map[EI_DATA] != HOST_DATA)
+    return -1;
+
+  elf->map = map;
+  elf->size = size;
+  elf->class = map[EI_CLASS];
+  if (elf->class == ELFCLASS64 && size >= sizeof (Elf64_Ehdr))
+    {
+      Elf64_Ehdr ehdr;
+
+      memcpy (&ehdr, map, sizeof ehdr);
+      elf->table = ehdr.e_shoff;
+      elf->entry_size = ehdr.e_shentsize;
+      elf->count = ehdr.e_shnum;
+      elf->names = ehdr.e_shstrndx;
+    }
+  else if (elf->class == ELFCLASS32 && size >= sizeof (Elf32_Ehdr))
+    {
+      Elf32_Ehdr ehdr;
+
+      memcpy (&ehdr, map, sizeof ehdr);
+      elf->table = ehdr.e_shoff;
+      elf->entry_size = ehdr.e_shentsize;
+      elf->count = ehdr.e_shnum;
+      elf->names = ehdr.e_shstrndx;
+    }
+  else
+    return -1;
+
+  /* Extended numbering (more than 0xff00 sections) isn't worth it. */
+  return elf->count == 0 ? -1 : 0;
+}
+
+/* String at 'offset' in the string table, or NULL if it's out of it.
+ * Length of the string is stored in 'length'. */
+static const char *
+string (const struct elf *elf, const struct section *table, uint64_t offset,
+        size_t *length)
+{
+  const char *s;
+
+  if (table->type != SHT_STRTAB || offset >= table->size)
+    return NULL;
+  s = (const char *) elf->map + table->offset + offset;
+  *length = strnlen (s, table->size - offset);
+  return s;
+}
+
+static int
+is_debug_name (const char *name)
+{
+  return strncmp (name, ".debug_", 7) == 0
+    || strncmp (name, ".zdebug_", 8) == 0;
+}
+
+static int
+is_debug_section (const struct elf *elf, const struct section *names,
+                  const struct section *section)
+{
+  size_t length;
+  const char *name = string (elf, names, section->name, &length);
+
+  return name != NULL && is_debug_name (name);
+}
+
+/* Hash ELF sections except debugging info. */
+static int
+hash_code (const struct elf *elf, uint64_t *digest)
+{
+  struct section names;
+  uint64_t *values;
+  size_t n = 0;
+  uint64_t i;
+
+  if (read_section (elf, elf->names, &names) < 0)
+    return -1;
+
+  /* Four values per section, hashed together at the end. */
+  values = malloc (elf->count * 4 * sizeof *values);
+  for (i = 0; i < elf->count; i++)
+    {
+      struct section section;
+      struct section target;
+      const char *name;
+      size_t length;
+
+      if (read_section (elf, i, &section) < 0
+          || (name = string (elf, &names, section.name, &length)) == NULL)
+        {
+          free (values);
+          return -1;
+        }
+      if (is_debug_name (name))
+        continue;
+      /* Relocations of debugging info. */
+      if ((section.type == SHT_REL || section.type == SHT_RELA)
+          && read_section (elf, section.info, &target) == 0
+          && is_debug_section (elf, &names, &target))
+        continue;
+
+      values[n++] = qake_xxh64 (name, length, 0);
+      values[n++] = section.type;
+      values[n++] = section.flags;
+      if (section.type == SHT_NOBITS)
+        values[n++] = section.size;
+      else
+        values[n++] = qake_xxh64 (elf->map + section.offset, section.size, 0);
+    }
+
+  *digest = qake_xxh64 (values, n * sizeof *values, 0);
+  free (values);
+  return 0;
+}
+
+/* What we need of a symbol, for both ELF classes. */
+struct symbol
+{
+  uint64_t name;
+  uint64_t info;
+  uint64_t other;
+  uint64_t index;
+  uint64_t size;
+};
+
+static void
+read_symbol (const struct elf *elf, const unsigned char *p,
+             struct symbol *symbol)
+{
+  if (elf->class == ELFCLASS64)
+    {
+      Elf64_Sym sym;
+
+      memcpy (&sym, p, sizeof sym);
+      symbol->name = sym.st_name;
+      symbol->info = sym.st_info;
+      symbol->other = sym.st_other;
+      symbol->index = sym.st_shndx;
+      symbol->size = sym.st_size;
+    }
+  else
+    {
+      Elf32_Sym sym;
+
+      memcpy (&sym, p, sizeof sym);
+      symbol->name = sym.st_name;
+      symbol->info = sym.st_info;
+      symbol->other = sym.st_other;
+      symbol->index = sym.st_shndx;
+      symbol->size = sym.st_size;
+    }
+}
+
+/* SONAME from the dynamic section, or NULL if there's none. */
+static const char *
+soname (const struct elf *elf, const struct section *dynamic, size_t *length)
+{
+  struct section strings;
+  size_t entry_size = elf->class == ELFCLASS64
+    ? sizeof (Elf64_Dyn) : sizeof (Elf32_Dyn);
+  uint64_t offset;
+
+  if (read_section (elf, dynamic->link, &strings) < 0)
+    return NULL;
+  for (offset = 0; offset + entry_size <= dynamic->size; offset += entry_size)
+    {
+      const unsigned char *p = elf->map + dynamic->offset + offset;
+      int64_t tag;
+      uint64_t value;
+
+      if (elf->class == ELFCLASS64)
+        {
+          Elf64_Dyn dyn;
+
+          memcpy (&dyn, p, sizeof dyn);
+          tag = dyn.d_tag;
+          value = dyn.d_un.d_val;
+        }
+      else
+        {
+          Elf32_Dyn dyn;
+
+          memcpy (&dyn, p, sizeof dyn);
+          tag = dyn.d_tag;
+          value = dyn.d_un.d_val;
+        }
+      if (tag == DT_NULL)
+        break;
+      if (tag == DT_SONAME)
+        return string (elf, &strings, value, length);
+    }
+  return NULL;
+}
+
+static int
+compare_digests (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *) a;
+  uint64_t y = *(const uint64_t *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+/* Hash SONAME and exported symbols.
+ * Order of symbols in the table depends on the linker's whims,
+ *   so digests of symbols are sorted before they're hashed together. */
+static int
+hash_abi (const struct elf *elf, uint64_t *digest)
+{
+  /* Zero type is SHT_NULL: the section isn't found (yet). */
+  struct section symbols = { 0 };
+  struct section versions = { 0 };
+  struct section strings;
+  uint64_t name_digest = 0;
+  uint64_t *values;
+  size_t n = 0;
+  uint64_t count;
+  uint64_t i;
+
+  for (i = 0; i < elf->count; i++)
+    {
+      struct section section;
+      const char *name;
+      size_t length;
+
+      if (read_section (elf, i, &section) < 0)
+        return -1;
+      if (section.type == SHT_DYNSYM)
+        symbols = section;
+      else if (section.type == SHT_GNU_versym)
+        versions = section;
+      else if (section.type == SHT_DYNAMIC
+               && (name = soname (elf, &section, &length)) != NULL)
+        name_digest = qake_xxh64 (name, length, 0);
+    }
+  /* It's not a shared library. */
+  if (symbols.type != SHT_DYNSYM
+      || symbols.entry_size < (elf->class == ELFCLASS64
+                               ? sizeof (Elf64_Sym) : sizeof (Elf32_Sym))
+      || read_section (elf, symbols.link, &strings) < 0)
+    return -1;
+
+  count = symbols.size / symbols.entry_size;
+  values = malloc ((count + 1) * sizeof *values);
+  /* SONAME goes first, it's not sorted with the rest. */
+  values[n++] = name_digest;
+  /* Symbol 0 is always empty. */
+  for (i = 1; i < count; i++)
+    {
+      struct symbol symbol;
+      const char *name;
+      size_t length;
+      uint64_t fields[5];
+      int type;
+
+      read_symbol (elf, elf->map + symbols.offset + i * symbols.entry_size,
+                   &symbol);
+      if (symbol.index == SHN_UNDEF
+          || ELF64_ST_BIND (symbol.info) == STB_LOCAL
+          || ELF64_ST_VISIBILITY (symbol.other) == STV_HIDDEN
+          || ELF64_ST_VISIBILITY (symbol.other) == STV_INTERNAL
+          || (name = string (elf, &strings, symbol.name, &length)) == NULL)
+        continue;
+
+      type = ELF64_ST_TYPE (symbol.info);
+      fields[0] = qake_xxh64 (name, length, 0);
+      fields[1] = symbol.info;
+      fields[2] = ELF64_ST_VISIBILITY (symbol.other);
+      fields[3] = type == STT_OBJECT || type == STT_TLS || type == STT_COMMON
+        ? symbol.size : 0;
+      fields[4] = 0;
+      if (versions.type == SHT_GNU_versym && (i + 1) * 2 <= versions.size)
+        {
+          uint16_t version;
+
+          memcpy (&version, elf->map + versions.offset + i * 2,
+                  sizeof version);
+          fields[4] = version;
+        }
+      values[n++] = qake_xxh64 (fields, sizeof fields, 0);
+    }
+
+  qsort (values + 1, n - 1, sizeof *values, compare_digests);
+  *digest = qake_xxh64 (values, n * sizeof *values, 0);
+  free (values);
+  return 0;
+}
+
+/* Map the file and hash it with 'hash'.
+ * Whole file is hashed if 'hash' doesn't understand it. */
+static int
+hash_elf_file (const char *path, uint64_t *digest,
+               int (*hash) (const struct elf *elf, uint64_t *digest))
+{
+  struct stat st;
+  unsigned char *map;
+  struct elf elf;
+  int fd = open (path, O_RDONLY);
+  int result = -1;
+
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (st.st_size == 0)
+    {
+      close (fd);
+      return qake_hash_file (path, digest);
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+  if (read_elf (map, st.st_size, &elf) == 0)
+    result = hash (&elf, digest);
+  munmap (map, st.st_size);
+
+  if (result == 0)
+    qake_count_hashed (st.st_size);
+
+  if (result < 0)
+    return qake_hash_file (path, digest);
+  return 0;
+}
+
+int
+qake_hash_object (const char *path, uint64_t *digest)
+{
+  return hash_elf_file (path, digest, hash_code);
+}
+
+int
+qake_hash_abi (const char *path, uint64_t *digest)
+{
+  return hash_elf_file (path, digest, hash_abi);
+}
@@ -0,0 +1,403 @@
+/*
+ * Loadable module for GNU Make.
+ *
+ * Hashing of sources, objects and commands used to be done by spawning
+ *   one 'md5sum' process per file.
+ * With this module loaded (see 'load' in prologue.mk) the hashing is done
+ *   right inside Make process, during expansion of the recipe.
+ * If the recipe expands to nothing, Make doesn't spawn anything at all.
+ *
+ * More on loadable objects:
+ * https://www.gnu.org/software/make/manual/html_node/Loading-Objects.html
+ *
+ * Functions provided:
+ *   $(qake-hash FILE...)  expands to hex digests of files, one per file.
+ *   $(qake-update STORE,FILE,MARKER)
+ *                         touches MARKER if contents of FILE differ from
+ *                         what's recorded in the hash store (see hashdb.c).
+ *                         Expands to nothing.
+ *   $(qake-update-object STORE,FILE,MARKER)
+ *                         same, but FILE is an object, and its' debugging
+ *                         info doesn't count (see object.c).
+ *   $(qake-update-abi STORE,FILE,MARKER)
+ *                         same, but FILE is a shared library, and only its'
+ *                         ABI counts (see object.c).
+ *   $(qake-update-header STORE,FILE,MARKER[,refresh])
+ *                         same, but FILE is a header: a marker made for
+ *                         the first time gets modification time of FILE,
+ *                         not the current one. What was compiled after
+ *                         FILE changed isn't compiled again for the sake
+ *                         of a new marker. With 'refresh', the digest
+ *                         of FILE is recorded, but an existing marker
+ *                         isn't touched: FILE is known to be compiled
+ *                         as it is now.
+ *   $(qake-update-header-code STORE,FILE,MARKER[,refresh])
+ *                         same, but comments and layout of FILE don't
+ *                         count (see source.c).
+ *   $(qake-mkdir DIR...)  creates directories, with their' parents,
+ *                         like 'mkdir -p'. Expands to nothing.
+ *
+ * If QAKE_STATS environment variable names a file, a line
+ *   'hashed FILES BYTES' is appended to it when Make exits: how many
+ *   files were hashed by this Make process, and how much was read.
+ *   The relay appends a line 'started 1' there for each process Make
+ *   starts (see relay.c). Test scripts check these against their' budgets
+ *   (see tests/budget.sh).
+ *
+ * The hash is XXH64: it's not cryptographic, but we don't need that -
+ *   we only want to know whether the file changed since last time.
+ * And it's way faster than MD5.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <gnumake.h>
+
+#include "qake.h"
+
+/* Make refuses to load modules not declaring this. */
+int plugin_is_GPL_compatible;
+
+/* Work done by this process, see QAKE_STATS above. */
+static unsigned long hashed_files;
+static unsigned long long hashed_bytes;
+
+void
+qake_count_hashed (uint64_t bytes)
+{
+  hashed_files++;
+  hashed_bytes += bytes;
+}
+
+static void
+report_stats (void)
+{
+  const char *path = getenv ("QAKE_STATS");
+  FILE *file;
+
+  if (path == NULL || *path == '\0')
+    return;
+  file = fopen (path, "a");
+  if (file == NULL)
+    return;
+  fprintf (file, "hashed %lu %llu\n", hashed_files, hashed_bytes);
+  fclose (file);
+}
+
+/* Report an error the usual Make way: this stops the build. */
+void
+qake_fail (const char *function, const char *file)
+{
+  char buf[4096];
+  snprintf (buf, sizeof buf, "$(error %s: %s: %s)",
+            function, file, strerror (errno));
+  gmk_eval (buf, NULL);
+}
+
+/* Hash the whole file. The file is mapped instead of read():
+ *   no copying into user-space buffers, and the kernel does read-ahead
+ *   as we go sequentially. */
+int
+qake_hash_file (const char *path, uint64_t *digest)
+{
+  struct stat st;
+  void *map;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  qake_count_hashed (st.st_size);
+  if (st.st_size == 0)
+    {
+      *digest = qake_xxh64 ("", 0, 0);
+      close (fd);
+      return 0;
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+  madvise (map, st.st_size, MADV_SEQUENTIAL);
+  *digest = qake_xxh64 (map, st.st_size, 0);
+  munmap (map, st.st_size);
+  return 0;
+}
+
+/* Apply FUNC to each whitespace-separated word of ARG,
+ *   joining results with single spaces.
+ * FUNC writes at most 'size' bytes of result into buf. */
+typedef int (*word_func) (const char *word, char *buf, size_t size);
+
+static char *
+map_words (const char *function, const char *arg, word_func func)
+{
+  char *words = strdup (arg);
+  char *result = NULL;
+  size_t length = 0;
+  size_t capacity = 0;
+  char *save = NULL;
+  char *word;
+
+  for (word = strtok_r (words, " \t\n", &save);
+       word != NULL;
+       word = strtok_r (NULL, " \t\n", &save))
+    {
+      char buf[128];
+      size_t n;
+
+      if (func (word, buf, sizeof buf) < 0)
+        {
+          qake_fail (function, word);
+          break;
+        }
+      n = strlen (buf);
+      /* Separator, value and terminating zero. */
+      if (length + n + 2 > capacity)
+        {
+          capacity = (length + n + 2) * 2;
+          result = realloc (result, capacity);
+        }
+      if (length > 0)
+        result[length++] = ' ';
+      memcpy (result + length, buf, n + 1);
+      length += n;
+    }
+  free (words);
+
+  if (result == NULL)
+    return NULL;
+
+  /* Make frees the result with its' own allocator. */
+  {
+    char *out = gmk_alloc (length + 1);
+    memcpy (out, result, length + 1);
+    free (result);
+    return out;
+  }
+}
+
+static int
+hash_word (const char *word, char *buf, size_t size)
+{
+  uint64_t digest;
+
+  if (qake_hash_file (word, &digest) < 0)
+    return -1;
+  snprintf (buf, size, "%016llx", (unsigned long long) digest);
+  return 0;
+}
+
+static char *
+func_hash (const char *name, unsigned int argc, char **argv)
+{
+  (void) argc;
+  return map_words (name, argv[0], hash_word);
+}
+
+/* Update modification time of the marker, creating it if needed.
+ * The time is the current one if 'times' is NULL. */
+static int
+touch (const char *path, const struct timespec *times)
+{
+  int fd = open (path, O_WRONLY | O_CREAT | O_NOCTTY, 0666);
+
+  if (fd < 0)
+    return -1;
+  if (futimens (fd, times) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return close (fd);
+}
+
+/* This is what the %.did_update recipe does with the store.
+ * The record is keyed by the marker, as there's one marker per tracked file.
+ *
+ * 1. If stat of the file is the same as recorded, contents are the same.
+ * 2. Otherwise, the file is hashed. If digest is the same, only stat
+ *      is recorded, so that next time we stop at step 1.
+ * 3. Otherwise, the marker is touched first and the digest is recorded
+ *      after that: see hashdb.c about crash safety.
+ * Marker is created whenever it's missing - Make needs it to exist.
+ *   If 'keep_mtime' is set, the new marker gets modification time
+ *   of the file: it's as old as the change it stands for.
+ *   If 'refresh' is set, an existing marker isn't touched at step 3. */
+typedef int (*hash_func) (const char *path, uint64_t *digest);
+
+static char *
+update (const char *name, char **argv, hash_func hash, int keep_mtime,
+        int refresh)
+{
+  struct hashdb *db = hashdb_open (argv[0]);
+  const char *file = argv[1];
+  const char *marker = argv[2];
+  const struct hashdb_record *recorded = hashdb_lookup (db, marker);
+  struct hashdb_record record;
+  struct stat st;
+  int has_marker = access (marker, F_OK) == 0;
+
+  if (stat (file, &st) < 0)
+    {
+      qake_fail (name, file);
+      return NULL;
+    }
+  if (recorded != NULL && has_marker && hashdb_same_stat (recorded, &st))
+    return NULL;
+
+  if (hash (file, &record.digest) < 0)
+    {
+      qake_fail (name, file);
+      return NULL;
+    }
+  hashdb_record_stat (&record, &st);
+
+  if (!has_marker && keep_mtime)
+    {
+      struct timespec times[2] = { st.st_mtim, st.st_mtim };
+
+      if (touch (marker, times) < 0)
+        {
+          qake_fail (name, marker);
+          return NULL;
+        }
+    }
+  else if (!has_marker
+           || (!refresh && (recorded == NULL
+                            || recorded->digest != record.digest)))
+    if (touch (marker, NULL) < 0)
+      {
+        qake_fail (name, marker);
+        return NULL;
+      }
+
+  hashdb_store (db, marker, &record);
+  return NULL;
+}
+
+static char *
+func_update (const char *name, unsigned int argc, char **argv)
+{
+  (void) argc;
+  return update (name, argv, qake_hash_file, 0, 0);
+}
+
+static char *
+func_update_object (const char *name, unsigned int argc, char **argv)
+{
+  (void) argc;
+  return update (name, argv, qake_hash_object, 0, 0);
+}
+
+static char *
+func_update_abi (const char *name, unsigned int argc, char **argv)
+{
+  (void) argc;
+  return update (name, argv, qake_hash_abi, 0, 0);
+}
+
+/* Whether the optional 4th argument, 'refresh', is given. */
+static int
+refresh_requested (unsigned int argc, char **argv)
+{
+  return argc > 3 && strcmp (argv[3], "refresh") == 0;
+}
+
+static char *
+func_update_header (const char *name, unsigned int argc, char **argv)
+{
+  return update (name, argv, qake_hash_file, 1,
+                 refresh_requested (argc, argv));
+}
+
+static char *
+func_update_header_code (const char *name, unsigned int argc, char **argv)
+{
+  return update (name, argv, qake_hash_code, 1,
+                 refresh_requested (argc, argv));
+}
+
+/* Create the directory and its' missing parents, like 'mkdir -p'. */
+static int
+make_directory (const char *path)
+{
+  char *copy;
+  char *slash;
+  int result = 0;
+
+  if (mkdir (path, 0777) == 0 || errno == EEXIST)
+    return 0;
+  if (errno != ENOENT)
+    return -1;
+
+  copy = strdup (path);
+  for (slash = strchr (copy + 1, '/'); slash != NULL;
+       slash = strchr (slash + 1, '/'))
+    {
+      *slash = '\0';
+      if (mkdir (copy, 0777) < 0 && errno != EEXIST)
+        {
+          result = -1;
+          break;
+        }
+      *slash = '/';
+    }
+  free (copy);
+  if (result == 0 && mkdir (path, 0777) < 0 && errno != EEXIST)
+    result = -1;
+  return result;
+}
+
+static char *
+func_mkdir (const char *name, unsigned int argc, char **argv)
+{
+  char *words = strdup (argv[0]);
+  char *save = NULL;
+  char *word;
+
+  (void) argc;
+  for (word = strtok_r (words, " \t\n", &save);
+       word != NULL;
+       word = strtok_r (NULL, " \t\n", &save))
+    if (make_directory (word) < 0)
+      {
+        qake_fail (name, word);
+        break;
+      }
+  free (words);
+  return NULL;
+}
+
+/* Entry point: Make calls <name of object>_gmk_setup after loading it. */
+int
+qake_gmk_setup (const gmk_floc *floc)
+{
+  (void) floc;
+  atexit (report_stats);
+  gmk_add_function ("qake-hash", func_hash, 1, 1, GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-update", func_update, 3, 3, GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-update-object", func_update_object, 3, 3,
+                    GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-update-abi", func_update_abi, 3, 3,
+                    GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-update-header", func_update_header, 3, 4,
+                    GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-update-header-code", func_update_header_code, 3, 4,
+                    GMK_FUNC_DEFAULT);
+  gmk_add_function ("qake-mkdir", func_mkdir, 1, 1, GMK_FUNC_DEFAULT);
+  return 1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Declarations shared between parts of the loadable module.
+ */
+#ifndef QAKE_H
+#define QAKE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/* xxhash.c */
+
+uint64_t qake_xxh64 (const void *data, size_t len, uint64_t seed);
+
+/* qake.c */
+
+int qake_hash_file (const char *path, uint64_t *digest);
+void qake_fail (const char *function, const char *file);
+void qake_count_hashed (uint64_t bytes);
+
+/* object.c */
+
+int qake_hash_object (const char *path, uint64_t *digest);
+int qake_hash_abi (const char *path, uint64_t *digest);
+
+/* source.c */
+
+int qake_hash_code (const char *path, uint64_t *digest);
+
+/* hashdb.c */
+
+/* What we remember about a tracked file.
+ * Stat fields let us skip hashing when the file wasn't touched. */
+struct hashdb_record
+{
+  uint64_t digest;
+  uint64_t ino;
+  int64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  int64_t ctime_sec;
+  int64_t ctime_nsec;
+  /* Stat was taken too close to modification of the file,
+   *   so it can't be trusted: see hashdb.c. */
+  uint64_t racy;
+};
+
+struct hashdb;
+
+struct hashdb *hashdb_open (const char *path);
+const struct hashdb_record *hashdb_lookup (struct hashdb *db, const char *key);
+void hashdb_store (struct hashdb *db, const char *key,
+                   const struct hashdb_record *record);
+
+void hashdb_record_stat (struct hashdb_record *record, const struct stat *st);
+int hashdb_same_stat (const struct hashdb_record *record,
+                      const struct stat *st);
+
+#endif
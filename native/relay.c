@@ -0,0 +1,1053 @@
+/*
+ * Native replacement of relay.sh.
+ *
+ * Make uses it as command interpreter (see SHELL in prologue.mk),
+ *   so it's started for every recipe.
+ * relay.sh costs a shell startup, an option parsing loop in shell,
+ *   'dirname' and 'mkdir' processes, and 'eval' of the command.
+ * Here, options are parsed and the command file is written natively,
+ *   and the command is exec'ed directly when it's simple enough,
+ *   or passed to /bin/sh otherwise.
+ *
+ * The protocol is the same as for relay.sh:
+ *   qake-relay [--target T] [--command-file F] [--build-dir B] [--phony]
+ *              [--prerequisites P... --] COMMAND
+ *
+ * Environment:
+ *   RELAY_VERBOSE - print what's going on to stderr;
+ *   RELAY_INFO    - print the command to stderr;
+ *   QAKE_TRACE    - append an event for the recipe to this file
+ *                   (see "Build timeline" below);
+ *   QAKE_JOB_WEIGHT, QAKE_JOB_MEMORY, QAKE_MAX_LOAD, QAKE_JOBS_LOCK
+ *                 - how many job slots the recipe takes, when
+ *                   the machine is too busy to start it, and where
+ *                   running jobs are registered (see "Job slots" below);
+ *   QAKE_PROGRESS - prefix output of the recipe with the progress
+ *                   of the build, planned in this file
+ *                   (see "Progress" below);
+ *   QAKE_STATS    - append a line 'started 1' to this file: test scripts
+ *                   count processes started by Make this way
+ *                   (see QAKE_STATS in qake.c).
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+struct options
+{
+  const char *target;
+  const char *command_file;
+  const char *build_dir;
+  int phony;
+  /* Space-separated list of updated prerequisites. */
+  char *prerequisites;
+  /* Command itself and its' words, if Make passed several. */
+  char **command;
+  int command_words;
+};
+
+static int verbose;
+
+static void
+parse_options (int argc, char **argv, struct options *options)
+{
+  int i = 1;
+  size_t length = 0;
+
+  memset (options, 0, sizeof *options);
+  options->prerequisites = calloc (1, 1);
+
+  while (i < argc)
+    {
+      const char *option = argv[i];
+
+      if (strcmp (option, "--build-dir") == 0 && i + 1 < argc)
+        {
+          options->build_dir = argv[i + 1];
+          i += 2;
+        }
+      else if (strcmp (option, "--command-file") == 0 && i + 1 < argc)
+        {
+          options->command_file = argv[i + 1];
+          i += 2;
+        }
+      else if (strcmp (option, "--target") == 0 && i + 1 < argc)
+        {
+          options->target = argv[i + 1];
+          i += 2;
+        }
+      else if (strcmp (option, "--prerequisites") == 0)
+        {
+          for (i++; i < argc && strcmp (argv[i], "--") != 0; i++)
+            {
+              size_t n = strlen (argv[i]);
+
+              options->prerequisites =
+                realloc (options->prerequisites, length + n + 2);
+              options->prerequisites[length++] = ' ';
+              memcpy (options->prerequisites + length, argv[i], n + 1);
+              length += n;
+            }
+          /* Skip the terminating '--'. */
+          if (i < argc)
+            i++;
+        }
+      else if (strcmp (option, "--phony") == 0)
+        {
+          options->phony = 1;
+          i++;
+        }
+      else
+        break;
+    }
+
+  options->command = argv + i;
+  options->command_words = argc - i;
+}
+
+/* Join the words of the command the same way "$@" does in relay.sh. */
+static char *
+join_command (struct options *options)
+{
+  size_t length = 0;
+  char *command;
+  int i;
+
+  for (i = 0; i < options->command_words; i++)
+    length += strlen (options->command[i]) + 1;
+  command = calloc (1, length + 1);
+  for (i = 0; i < options->command_words; i++)
+    {
+      if (i > 0)
+        strcat (command, " ");
+      strcat (command, options->command[i]);
+    }
+  return command;
+}
+
+/* mkdir -p of the directory part of the path. */
+static void
+make_parent_directories (const char *path)
+{
+  char *copy = strdup (path);
+  char *p;
+
+  for (p = copy + 1; *p != '\0'; p++)
+    if (*p == '/')
+      {
+        *p = '\0';
+        if (mkdir (copy, 0777) < 0 && errno != EEXIST)
+          break;
+        *p = '/';
+      }
+  free (copy);
+}
+
+static int
+write_command_file (const char *path, const char *command)
+{
+  FILE *file;
+
+  make_parent_directories (path);
+  file = fopen (path, "w");
+  if (file == NULL)
+    return -1;
+  fprintf (file, "%s\n", command);
+  return fclose (file);
+}
+
+/* Characters which need shell to be interpreted.
+ * This is the same idea as in Make itself (see job.c there):
+ *   commands without these can be exec'ed directly. */
+static const char shell_characters[] = "#;\"*?[]&|<>(){}$`'~!\\=%\n";
+
+/* Shell builtins and keywords, which look like simple commands,
+ *   but have no executable to be exec'ed. */
+static const char *const shell_commands[] = {
+  ".", ":", "alias", "bg", "break", "case", "cd", "command", "continue",
+  "eval", "exec", "exit", "export", "fc", "fg", "for", "getopts", "hash",
+  "if", "jobs", "login", "logout", "read", "readonly", "return", "set",
+  "shift", "test", "times", "trap", "type", "ulimit", "umask", "unalias",
+  "unset", "wait", "while", NULL
+};
+
+/* Split the command into words if it's simple enough to skip the shell.
+ * Returns NULL if shell is needed. */
+static char **
+split_simple_command (const char *command)
+{
+  char **words;
+  char *copy;
+  char *save = NULL;
+  char *word;
+  size_t count = 0;
+  int i;
+
+  if (strpbrk (command, shell_characters) != NULL)
+    return NULL;
+
+  copy = strdup (command);
+  words = calloc (strlen (command) / 2 + 2, sizeof *words);
+  for (word = strtok_r (copy, " \t", &save);
+       word != NULL;
+       word = strtok_r (NULL, " \t", &save))
+    words[count++] = word;
+
+  if (count == 0)
+    {
+      free (words);
+      free (copy);
+      return NULL;
+    }
+  for (i = 0; shell_commands[i] != NULL; i++)
+    if (strcmp (words[0], shell_commands[i]) == 0)
+      {
+        free (words);
+        free (copy);
+        return NULL;
+      }
+  return words;
+}
+
+/* Replace this process with the command. Doesn't return. */
+static void
+exec_command (const char *command)
+{
+  char **words = split_simple_command (command);
+
+  if (words != NULL)
+    {
+      execvp (words[0], words);
+      fprintf (stderr, "qake-relay: %s: %s\n", words[0], strerror (errno));
+      _exit (127);
+    }
+
+  /* -e is what 'set -e' does in relay.sh. */
+  execl ("/bin/sh", "sh", "-e", "-c", command, (char *) NULL);
+  fprintf (stderr, "qake-relay: /bin/sh: %s\n", strerror (errno));
+  _exit (127);
+}
+
+static int
+lock_byte (int fd, off_t offset, int type, int wait)
+{
+  struct flock lock;
+
+  memset (&lock, 0, sizeof lock);
+  lock.l_type = type;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = offset;
+  lock.l_len = 1;
+  return fcntl (fd, wait ? F_SETLKW : F_SETLK, &lock);
+}
+
+/* Job slots.
+ *
+ * Make hands out job slots with its' jobserver: a pipe with a token
+ *   (a byte) per free slot. Each job Make starts costs one token,
+ *   and so does each job started by sub-Makes.
+ * Here, recipes which are known to be heavy take more slots:
+ *   weight of the recipe is QAKE_JOB_WEIGHT, set per target
+ *   in prologue.mk (see JOB_WEIGHT there). The extra tokens are read
+ *   from the same pipe, and written back when the command finishes.
+ *
+ * Make only passes the pipe to recipes it thinks are sub-Makes,
+ *   so we open it through /proc. That gives us our own open file,
+ *   so it can be made non-blocking without Make noticing.
+ *
+ * Before starting, the relay also waits while the machine is short of
+ *   memory (less than QAKE_JOB_MEMORY megabytes available per slot
+ *   we take) or overloaded (1-minute load average above QAKE_MAX_LOAD,
+ *   twice the number of cores by default).
+ * That's only done while other jobs are running: they're what
+ *   frees the memory, so waiting for nothing would never end.
+ *   Running jobs hold a read lock of the first byte of QAKE_JOBS_LOCK
+ *   file: the lock is kept across exec() and freed by the kernel when
+ *   the job exits, however it does.
+ *
+ * Tokens are taken all at once, or not at all, and retried with backoff:
+ *   otherwise two heavy jobs could wait for each other's tokens forever.
+ * Without jobserver (no -j, or bare -j), nothing of this is done. */
+struct jobserver
+{
+  int read_fd;
+  int write_fd;
+  /* The N of -jN. */
+  int slots;
+  /* Tokens we took, to give back exactly what we got. */
+  char tokens[256];
+  int taken;
+};
+
+static struct jobserver jobserver = { -1, -1, 0, "", 0 };
+
+static const char *
+getenv_nonempty (const char *name)
+{
+  const char *value = getenv (name);
+
+  return value != NULL && *value != '\0' ? value : NULL;
+}
+
+/* Count this process in QAKE_STATS. The line is short enough
+ *   to be appended at once by concurrent jobs. */
+static void
+count_start (void)
+{
+  static const char line[] = "started 1\n";
+  const char *stats = getenv_nonempty ("QAKE_STATS");
+  int fd;
+
+  if (stats == NULL)
+    return;
+  fd = open (stats, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (fd < 0)
+    return;
+  if (write (fd, line, sizeof line - 1) < 0)
+    fprintf (stderr, "qake-relay: %s: %s\n", stats, strerror (errno));
+  close (fd);
+}
+
+/* Register this process as a running job.
+ * The file isn't closed on exec(), so that the lock stays with the job. */
+static void
+register_running_job (void)
+{
+  const char *path = getenv_nonempty ("QAKE_JOBS_LOCK");
+  int fd;
+
+  if (path == NULL)
+    return;
+  fd = open (path, O_RDWR | O_CREAT, 0666);
+  if (fd >= 0)
+    lock_byte (fd, 0, F_RDLCK, 0);
+}
+
+/* Whether any job is running, apart from us. */
+static int
+other_jobs_running (void)
+{
+  const char *path = getenv_nonempty ("QAKE_JOBS_LOCK");
+  struct flock lock;
+  int fd;
+  int running;
+
+  if (path == NULL)
+    return 0;
+  fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return 0;
+  memset (&lock, 0, sizeof lock);
+  lock.l_type = F_WRLCK;
+  lock.l_whence = SEEK_SET;
+  lock.l_start = 0;
+  lock.l_len = 1;
+  running = fcntl (fd, F_GETLK, &lock) == 0 && lock.l_type != F_UNLCK;
+  close (fd);
+  return running;
+}
+
+/* Open end of the jobserver pipe of our parent, or our own. */
+static int
+open_jobserver_fd (const char *fd, int flags)
+{
+  char path[64];
+  int result;
+
+  snprintf (path, sizeof path, "/proc/%ld/fd/%s", (long) getppid (), fd);
+  result = open (path, flags | O_CLOEXEC);
+  if (result < 0)
+    {
+      snprintf (path, sizeof path, "/proc/self/fd/%s", fd);
+      result = open (path, flags | O_CLOEXEC);
+    }
+  return result;
+}
+
+/* Find the jobserver in MAKEFLAGS: " -j4 --jobserver-auth=3,4".
+ * Make 4.0 and 4.1 call it --jobserver-fds, Make 4.4 may use
+ *   a named pipe: --jobserver-auth=fifo:PATH. */
+static int
+open_jobserver (void)
+{
+  const char *flags = getenv ("MAKEFLAGS");
+  const char *auth;
+  const char *j;
+  char read_fd[16];
+  char write_fd[16];
+
+  if (jobserver.read_fd >= 0)
+    return 0;
+  if (flags == NULL)
+    return -1;
+  for (j = strstr (flags, "-j"); j != NULL; j = strstr (j + 2, "-j"))
+    if (j[2] >= '1' && j[2] <= '9')
+      jobserver.slots = atoi (j + 2);
+  auth = strstr (flags, "--jobserver-auth=");
+  if (auth == NULL)
+    auth = strstr (flags, "--jobserver-fds=");
+  if (auth == NULL || jobserver.slots < 2)
+    return -1;
+  auth = strchr (auth, '=') + 1;
+
+  if (strncmp (auth, "fifo:", 5) == 0)
+    {
+      char path[4096];
+
+      sscanf (auth + 5, "%4095s", path);
+      jobserver.read_fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      jobserver.write_fd = open (path, O_WRONLY | O_CLOEXEC);
+    }
+  else if (sscanf (auth, "%15[0-9],%15[0-9]", read_fd, write_fd) == 2)
+    {
+      jobserver.read_fd = open_jobserver_fd (read_fd, O_RDONLY | O_NONBLOCK);
+      jobserver.write_fd = open_jobserver_fd (write_fd, O_WRONLY);
+    }
+  if (jobserver.read_fd < 0 || jobserver.write_fd < 0)
+    {
+      if (jobserver.read_fd >= 0)
+        close (jobserver.read_fd);
+      jobserver.read_fd = -1;
+      return -1;
+    }
+  return 0;
+}
+
+/* Take up to 'count' more tokens without waiting.
+ * Returns how many were taken. */
+static int
+take_tokens (int count)
+{
+  int total = 0;
+
+  if ((size_t) (jobserver.taken + count) > sizeof jobserver.tokens)
+    count = sizeof jobserver.tokens - jobserver.taken;
+  while (total < count)
+    {
+      ssize_t n = read (jobserver.read_fd, jobserver.tokens + jobserver.taken,
+                        count - total);
+
+      if (n <= 0)
+        break;
+      jobserver.taken += n;
+      total += n;
+    }
+  return total;
+}
+
+/* Give back the last 'count' tokens taken. Async-signal-safe. */
+static void
+give_tokens (int count)
+{
+  while (count > 0)
+    {
+      ssize_t n = write (jobserver.write_fd,
+                         jobserver.tokens + jobserver.taken - count, count);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      jobserver.taken -= n;
+      count -= n;
+    }
+}
+
+static void
+give_tokens_and_die (int signal_number)
+{
+  give_tokens (jobserver.taken);
+  signal (signal_number, SIG_DFL);
+  raise (signal_number);
+}
+
+/* Value of a "Key:   1234 kB" line of /proc/meminfo, or -1. */
+static long
+available_memory_mb (void)
+{
+  char line[256];
+  long kb = -1;
+  FILE *meminfo = fopen ("/proc/meminfo", "r");
+
+  if (meminfo == NULL)
+    return -1;
+  while (fgets (line, sizeof line, meminfo) != NULL)
+    if (sscanf (line, "MemAvailable: %ld", &kb) == 1)
+      break;
+  fclose (meminfo);
+  return kb < 0 ? -1 : kb / 1024;
+}
+
+static double
+load_average (void)
+{
+  double load = -1;
+  FILE *loadavg = fopen ("/proc/loadavg", "r");
+
+  if (loadavg == NULL)
+    return -1;
+  if (fscanf (loadavg, "%lf", &load) != 1)
+    load = -1;
+  fclose (loadavg);
+  return load;
+}
+
+/* Whether the machine can afford a job taking 'weight' slots. */
+static int
+machine_can_afford (int weight)
+{
+  const char *job_memory = getenv_nonempty ("QAKE_JOB_MEMORY");
+  const char *max_load = getenv_nonempty ("QAKE_MAX_LOAD");
+  double load_limit = max_load != NULL
+    ? atof (max_load) : 2.0 * sysconf (_SC_NPROCESSORS_ONLN);
+  long memory;
+  double load;
+
+  if (job_memory != NULL && atol (job_memory) > 0)
+    {
+      memory = available_memory_mb ();
+      if (memory >= 0 && memory < weight * atol (job_memory))
+        return 0;
+    }
+  load = load_average ();
+  return load < 0 || load_limit <= 0 || load <= load_limit;
+}
+
+/* Take weight - 1 extra slots (Make gave us one already),
+ *   waiting for them and for the machine to afford the job.
+ * Returns how many extra tokens are held. */
+static int
+acquire_slots (int weight)
+{
+  struct timespec backoff = { 0, 10 * 1000 * 1000 };
+  int extra;
+
+  if (weight <= 1 && machine_can_afford (1))
+    return 0;
+  if (open_jobserver () < 0)
+    return 0;
+  if (weight > jobserver.slots)
+    weight = jobserver.slots;
+  extra = weight - 1;
+
+  for (;;)
+    {
+      if (take_tokens (extra) == extra
+          && (machine_can_afford (weight) || !other_jobs_running ()))
+        break;
+      give_tokens (jobserver.taken);
+      if (verbose)
+        fprintf (stderr, "Waiting for %d job slots\n", weight);
+      nanosleep (&backoff, NULL);
+      if (backoff.tv_nsec < 500 * 1000 * 1000)
+        backoff.tv_nsec *= 2;
+    }
+
+  if (jobserver.taken > 0)
+    {
+      signal (SIGINT, give_tokens_and_die);
+      signal (SIGTERM, give_tokens_and_die);
+      signal (SIGHUP, give_tokens_and_die);
+    }
+  return jobserver.taken;
+}
+
+/* Build timeline.
+ *
+ * Each recipe appends one "complete" event to the trace file
+ *   in Chrome trace format. The file can be opened in chrome://tracing
+ *   or https://ui.perfetto.dev as is.
+ * The format allows the closing ']' of the array to be omitted,
+ *   so the file is valid after each event, and events are just appended.
+ *
+ * Jobs run concurrently, so each event is written with a single write()
+ *   under a lock of the first byte of the file. Whoever finds the file
+ *   empty under the lock writes the opening '[' (prologue.mk writes it
+ *   at the start of each build, when it can).
+ *
+ * "tid" of the event is the job slot: the lowest number not taken by
+ *   other running jobs. Slots are locks of bytes past the first one,
+ *   held until the relay exits, so the kernel frees them for us
+ *   even if we're killed. Timeline viewers show one row per slot,
+ *   and empty rows mean idle cores.
+ * "pid" is Make's pid, so the rows of one build are grouped together.
+ *
+ * Cost of that is a fork() and a couple of fcntl() calls per recipe:
+ *   the relay has to wait for the command to get its' rusage. */
+struct trace
+{
+  int fd;
+  int slot;
+  struct timespec start;
+};
+
+/* There are never more jobs running than that, even with bare -j. */
+#define TRACE_SLOTS 4096
+
+static int
+start_trace (struct trace *trace, const char *path)
+{
+  trace->fd = open (path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+  if (trace->fd < 0)
+    return -1;
+  for (trace->slot = 0; trace->slot < TRACE_SLOTS; trace->slot++)
+    if (lock_byte (trace->fd, 1 + trace->slot, F_WRLCK, 0) == 0)
+      break;
+  clock_gettime (CLOCK_MONOTONIC, &trace->start);
+  return 0;
+}
+
+/* Write the string as JSON string contents. */
+static void
+write_json_string (FILE *out, const char *s)
+{
+  for (; *s != '\0'; s++)
+    if (*s == '"' || *s == '\\')
+      fprintf (out, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf (out, "\\u%04x", *s);
+    else
+      fputc (*s, out);
+}
+
+static long long
+microseconds (const struct timeval *tv)
+{
+  return (long long) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void
+finish_trace (struct trace *trace, const char *name, pid_t pid, int status,
+              const struct rusage *usage)
+{
+  struct timespec end;
+  struct stat st;
+  long long start_us;
+  char *event = NULL;
+  size_t size = 0;
+  FILE *out = open_memstream (&event, &size);
+
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  start_us = (long long) trace->start.tv_sec * 1000000
+    + trace->start.tv_nsec / 1000;
+
+  fputs ("{\"name\":\"", out);
+  write_json_string (out, name);
+  fprintf (out, "\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,"
+           "\"pid\":%ld,\"tid\":%d,\"args\":{\"pid\":%ld,",
+           start_us,
+           (long long) end.tv_sec * 1000000 + end.tv_nsec / 1000 - start_us,
+           (long) getppid (), trace->slot, (long) pid);
+  if (WIFSIGNALED (status))
+    fprintf (out, "\"signal\":%d,", WTERMSIG (status));
+  else
+    fprintf (out, "\"status\":%d,", WEXITSTATUS (status));
+  fprintf (out, "\"cpu_us\":%lld,\"max_rss_kb\":%ld}},\n",
+           microseconds (&usage->ru_utime) + microseconds (&usage->ru_stime),
+           usage->ru_maxrss);
+  fclose (out);
+
+  if (lock_byte (trace->fd, 0, F_WRLCK, 1) == 0)
+    {
+      if (fstat (trace->fd, &st) == 0 && st.st_size == 0
+          && write (trace->fd, "[\n", 2) < 0)
+        size = 0;
+      if (size > 0 && write (trace->fd, event, size) < 0)
+        fprintf (stderr, "qake-relay: trace: %s\n", strerror (errno));
+    }
+  free (event);
+  close (trace->fd);
+}
+
+/* Progress.
+ *
+ * With PROGRESS=y, qake plans the build before starting it:
+ *   progress.awk lists the targets Make would update, with their'
+ *   durations from the history, in QAKE_PROGRESS (sorted by name),
+ *   and starts the counter in QAKE_PROGRESS.state (see there).
+ * Each recipe which prints something counts as done, and its' first
+ *   line gets a prefix:
+ *   [12/40 ETA 1:05] GCC ircq.c.o
+ * Targets not in the plan are added to it as they're done. Planned
+ *   targets may never run, when the native module finds that what they're
+ *   made of didn't change, so the last count may fall short of the plan.
+ * The ETA is the time spent so far, scaled by the durations left to
+ *   the durations done: it's as parallel as the build was up to now.
+ *   The start of the build is modification time of the plan.
+ *
+ * The counts should go up in the order Make prints the output.
+ * With output synchronization (-O, which qake passes unless it's -j1),
+ *   standard output is a temporary file of Make's own, already unlinked,
+ *   which is printed when the recipe finishes. So the counter is taken
+ *   when the command finishes, and the prefix is inserted in front of
+ *   what it wrote there.
+ * Otherwise, the output goes out as it's written: the command writes
+ *   into a pipe, and the counter is taken when the first of it comes.
+ *   Only standard output goes through the pipe (descriptions of RUN are
+ *   printed there), so that compilers still see the terminal. */
+struct progress
+{
+  const char *plan;
+  int synchronized;
+  /* Where the output of the recipe starts in the file: its' size. */
+  off_t start;
+};
+
+static void
+start_progress (struct progress *progress, const char *plan)
+{
+  struct stat st;
+
+  progress->plan = plan;
+  progress->synchronized = fstat (STDOUT_FILENO, &st) == 0
+    && S_ISREG (st.st_mode) && st.st_nlink == 0;
+  progress->start = progress->synchronized ? st.st_size : 0;
+}
+
+/* Weight of the target in the plan, or -1 if it isn't there.
+ * Lines of the plan are "target weight", sorted: binary search. */
+static long long
+planned_weight (const char *plan, const char *target)
+{
+  size_t length = strlen (target);
+  long long weight = -1;
+  struct stat st;
+  const char *map;
+  size_t low = 0;
+  size_t high;
+  int fd = open (plan, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0 || st.st_size == 0)
+    {
+      close (fd);
+      return -1;
+    }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  high = st.st_size;
+  while (low < high)
+    {
+      size_t line = low + (high - low) / 2;
+      const char *end;
+      size_t name;
+      int order;
+
+      while (line > low && map[line - 1] != '\n')
+        line--;
+      end = memchr (map + line, '\n', st.st_size - line);
+      if (end == NULL)
+        end = map + st.st_size;
+      for (name = 0; map + line + name < end && map[line + name] != ' ';
+           name++)
+        ;
+
+      order = memcmp (target, map + line, length < name ? length : name);
+      if (order == 0)
+        order = length < name ? -1 : length > name ? 1 : 0;
+      if (order == 0)
+        {
+          weight = atoll (map + line + name);
+          break;
+        }
+      if (order < 0)
+        high = line;
+      else
+        low = end - map + 1;
+    }
+  munmap ((void *) map, st.st_size);
+  return weight;
+}
+
+/* Count the target as done, and write the prefix for its' output.
+ * If the command is still running, the ETA doesn't count it as done yet.
+ * Returns length of the prefix, or -1 if there's no counter. */
+static int
+count_progress (struct progress *progress, const char *target,
+                int running, char *prefix, size_t size)
+{
+  char path[4096];
+  char state[64];
+  int done, planned;
+  long long total_us, done_us;
+  long long weight = planned_weight (progress->plan, target);
+  struct timespec now;
+  struct stat st;
+  int n;
+  int fd;
+
+  snprintf (path, sizeof path, "%s.state", progress->plan);
+  fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  /* The lock is freed by close(). */
+  if (lock_byte (fd, 0, F_WRLCK, 1) < 0
+      || (n = pread (fd, state, sizeof state - 1, 0)) <= 0)
+    {
+      close (fd);
+      return -1;
+    }
+  state[n] = '\0';
+  if (sscanf (state, "%d %d %lld %lld",
+              &done, &planned, &total_us, &done_us) != 4)
+    {
+      close (fd);
+      return -1;
+    }
+  done++;
+  if (weight < 0)
+    planned++;
+  else
+    done_us += weight;
+  n = snprintf (state, sizeof state, "%10d %10d %15lld %15lld\n",
+                done, planned, total_us, done_us);
+  if (pwrite (fd, state, n, 0) < 0)
+    fprintf (stderr, "qake-relay: %s: %s\n", path, strerror (errno));
+  close (fd);
+
+  if (running && weight > 0)
+    done_us -= weight;
+  n = snprintf (prefix, size, "[%d/%d", done, planned);
+  clock_gettime (CLOCK_REALTIME, &now);
+  if (done_us > 0 && stat (progress->plan, &st) == 0)
+    {
+      double elapsed = (now.tv_sec - st.st_mtim.tv_sec)
+        + (now.tv_nsec - st.st_mtim.tv_nsec) / 1e9;
+      long long left = total_us > done_us
+        ? (long long) (elapsed * (total_us - done_us) / done_us) : 0;
+
+      if (left >= 3600)
+        n += snprintf (prefix + n, size - n, " ETA %lld:%02lld:%02lld",
+                       left / 3600, left / 60 % 60, left % 60);
+      else
+        n += snprintf (prefix + n, size - n, " ETA %lld:%02lld",
+                       left / 60, left % 60);
+    }
+  return n + snprintf (prefix + n, size - n, "] ");
+}
+
+static int
+write_all (int fd, const char *data, size_t size)
+{
+  while (size > 0)
+    {
+      ssize_t n = write (fd, data, size);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      data += n;
+      size -= n;
+    }
+  return 0;
+}
+
+/* Copy the output of the command from the pipe to standard output,
+ *   counting the target as done when the first of it comes. */
+static void
+relay_output (struct progress *progress, const char *target, int fd)
+{
+  char buffer[65536];
+  char prefix[64];
+  int counted = 0;
+  ssize_t n;
+
+  while ((n = read (fd, buffer, sizeof buffer)) != 0)
+    {
+      if (n < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (!counted++)
+        {
+          int length = count_progress (progress, target, 1,
+                                       prefix, sizeof prefix);
+
+          if (length > 0)
+            write_all (STDOUT_FILENO, prefix, length);
+        }
+      write_all (STDOUT_FILENO, buffer, n);
+    }
+  close (fd);
+}
+
+/* Count the target as done if the command wrote something into
+ *   the synchronized output, and put the prefix in front of that. */
+static void
+finish_progress (struct progress *progress, const char *target)
+{
+  char prefix[64];
+  struct stat st;
+  char *output;
+  off_t size;
+  int n;
+  int fd;
+
+  if (fstat (STDOUT_FILENO, &st) < 0 || st.st_size <= progress->start)
+    return;
+  n = count_progress (progress, target, 0, prefix, sizeof prefix);
+  if (n <= 0)
+    return;
+
+  /* Move the output to make room for the prefix.
+   * Make opens the file with O_APPEND, which makes pwrite() append too,
+   *   so it's written through a file of our own. */
+  size = st.st_size - progress->start;
+  output = malloc (size);
+  fd = open ("/proc/self/fd/1", O_RDWR | O_CLOEXEC);
+  if (output == NULL || fd < 0
+      || pread (fd, output, size, progress->start) != size
+      || pwrite (fd, prefix, n, progress->start) != n
+      || pwrite (fd, output, size, progress->start + n) != size)
+    fprintf (stderr, "qake-relay: progress: %s\n", strerror (errno));
+  else
+    lseek (STDOUT_FILENO, st.st_size + n, SEEK_SET);
+  if (fd >= 0)
+    close (fd);
+  free (output);
+}
+
+/* Run the command in a child, then record it in the trace and count it
+ *   as done (if asked to), and give back the extra job slots.
+ * Exits the same way the command did. */
+static int
+run_and_wait (struct trace *trace, struct progress *progress,
+              const char *name, const char *command)
+{
+  struct rusage usage;
+  int status;
+  int output[2] = { -1, -1 };
+  pid_t pid;
+
+  if (progress != NULL && !progress->synchronized && pipe (output) < 0)
+    progress = NULL;
+  pid = fork ();
+  if (pid < 0)
+    {
+      give_tokens (jobserver.taken);
+      if (trace != NULL)
+        close (trace->fd);
+      if (output[0] >= 0)
+        {
+          close (output[0]);
+          close (output[1]);
+        }
+      exec_command (command);
+    }
+  if (pid == 0)
+    {
+      if (output[1] >= 0)
+        {
+          dup2 (output[1], STDOUT_FILENO);
+          close (output[0]);
+          close (output[1]);
+        }
+      exec_command (command);
+    }
+  if (output[0] >= 0)
+    {
+      close (output[1]);
+      relay_output (progress, name, output[0]);
+    }
+
+  while (wait4 (pid, &status, 0, &usage) < 0)
+    if (errno != EINTR)
+      {
+        fprintf (stderr, "qake-relay: wait: %s\n", strerror (errno));
+        give_tokens (jobserver.taken);
+        return 127;
+      }
+  give_tokens (jobserver.taken);
+  if (trace != NULL)
+    finish_trace (trace, name, pid, status, &usage);
+  if (progress != NULL && progress->synchronized)
+    finish_progress (progress, name);
+
+  if (WIFSIGNALED (status))
+    {
+      /* Let Make see the command was killed, not that it failed. */
+      signal (WTERMSIG (status), SIG_DFL);
+      raise (WTERMSIG (status));
+      return 128 + WTERMSIG (status);
+    }
+  return WEXITSTATUS (status);
+}
+
+int
+main (int argc, char **argv)
+{
+  struct options options;
+  struct trace trace;
+  struct progress progress;
+  const char *trace_file;
+  const char *plan;
+  int tracing, counting;
+  const char *weight;
+  char *command;
+
+  verbose = getenv ("RELAY_VERBOSE") != NULL && *getenv ("RELAY_VERBOSE");
+  count_start ();
+  parse_options (argc, argv, &options);
+  command = join_command (&options);
+
+  if (getenv ("RELAY_INFO") != NULL && *getenv ("RELAY_INFO"))
+    fprintf (stderr, "%s\n", command);
+  if (verbose)
+    {
+      fprintf (stderr, "Making %s with command %s, with updated prereqs %s,"
+               " putting command into %s, build dir is %s\n",
+               options.target ? options.target : "", command,
+               options.prerequisites,
+               options.command_file ? options.command_file : "",
+               options.build_dir ? options.build_dir : "");
+      if (options.phony)
+        fprintf (stderr, "We're building phony target\n");
+    }
+
+  if (options.command_file != NULL && *options.command_file != '\0'
+      && write_command_file (options.command_file, command) < 0)
+    {
+      fprintf (stderr, "qake-relay: %s: %s\n",
+               options.command_file, strerror (errno));
+      return 1;
+    }
+
+  if (verbose)
+    fprintf (stderr, "Resulting CMD: %s\n", command);
+
+  weight = getenv_nonempty ("QAKE_JOB_WEIGHT");
+  acquire_slots (weight != NULL ? atoi (weight) : 1);
+  register_running_job ();
+
+  trace_file = getenv_nonempty ("QAKE_TRACE");
+  tracing = trace_file != NULL && start_trace (&trace, trace_file) == 0;
+  plan = getenv_nonempty ("QAKE_PROGRESS");
+  counting = plan != NULL && options.target != NULL;
+  if (counting)
+    start_progress (&progress, plan);
+  if (tracing || counting || jobserver.taken > 0)
+    return run_and_wait (tracing ? &trace : NULL,
+                         counting ? &progress : NULL,
+                         options.target ? options.target : command,
+                         command);
+
+  exec_command (command);
+  return 127;
+}
@@ -0,0 +1,312 @@
+/*
+ * Hashing of C and C++ sources by their code: comments and layout
+ *   don't count.
+ *
+ * This is what tokens.awk does to preprocessed sources for cache.sh,
+ *   done to headers as they are, right in Make process. The text is
+ *   reduced to what the compiler sees, and the reduced text is hashed:
+ *   - lines ending with a backslash are joined with the next ones;
+ *   - every comment becomes a space;
+ *   - every run of spaces, including line breaks, becomes one space;
+ *   - the space is dropped altogether, unless characters on both sides
+ *     of it could be a part of one token: 'a + 1' becomes 'a+1',
+ *     but 'a+ +b' doesn't become 'a++b', which is a different program.
+ * Directives are line-oriented, so each one is kept on a line of its' own,
+ *   and spaces in them are kept, one for a run: '#define F (x)' isn't
+ *   '#define F(x)'.
+ * Contents of character and string literals are copied as is,
+ *   C++ raw strings included. An unterminated literal is copied up to the
+ *   end of the line. None of this can make two different programs the same:
+ *   anything we don't understand only makes two fingerprints differ.
+ *
+ * Line numbers are lost this way: if only they changed, __LINE__
+ *   and debugging info of the code using the header stay as they were
+ *   the last time it was compiled. That's why it's optional:
+ *   see IGNORE_HEADER_COMMENTS in prologue.mk.
+ */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "qake.h"
+
+/* Pairs of characters starting punctuators longer than one character. */
+static const char punctuators[] =
+  " ++ -- -> >* += -= *= /= %= &= |= ^= << >> <= >= => == != "
+  "&& || :: ## <: :> <% %> %: :% .* // /* ";
+
+/* Text being reduced, and the reduced text. */
+struct reduction
+{
+  const char *p;
+  const char *end;
+  char *out;
+  size_t length;
+  /* Last character written, or 0 at the start of a line. */
+  char last;
+  /* There was a space (or a comment) after it. */
+  int pending;
+  /* Only spaces were seen since the last line break. */
+  int line_start;
+  int directive;
+  /* The chunk being written started with a digit: 1'000 is a number. */
+  int number;
+};
+
+static int
+is_word (char c)
+{
+  return (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z')
+    || (c >= '0' && c <= '9') || c == '_';
+}
+
+static int
+is_space (char c)
+{
+  return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+}
+
+/* Whether a space between characters 'a' and 'b' may separate tokens. */
+static int
+joinable (char a, char b)
+{
+  char pair[5] = { ' ', a, b, ' ', '\0' };
+
+  /* Identifiers, numbers, encoding prefixes and suffixes of literals. */
+  if ((is_word (a) || strchr (".'\"", a))
+      && (is_word (b) || strchr (".'\"", b)))
+    return 1;
+  /* Exponent of a number: 1e+5. */
+  if (strchr ("eEpP", a) && (b == '-' || b == '+'))
+    return 1;
+  return strstr (punctuators, pair) != NULL;
+}
+
+/* Skip backslash-newlines: they join lines before anything else. */
+static void
+join_lines (struct reduction *r)
+{
+  for (;;)
+    if (r->end - r->p >= 2 && r->p[0] == '\\' && r->p[1] == '\n')
+      r->p += 2;
+    else if (r->end - r->p >= 3 && r->p[0] == '\\' && r->p[1] == '\r'
+             && r->p[2] == '\n')
+      r->p += 3;
+    else
+      return;
+}
+
+/* Next character after splicing, or 0 at the end. */
+static char
+peek (struct reduction *r)
+{
+  join_lines (r);
+  return r->p < r->end ? *r->p : '\0';
+}
+
+static char
+next (struct reduction *r)
+{
+  char c = peek (r);
+
+  if (r->p < r->end)
+    r->p++;
+  return c;
+}
+
+/* Write a character of code, preceded by a space if needed. */
+static void
+emit (struct reduction *r, char c)
+{
+  if (r->pending && r->last
+      && (r->directive || joinable (r->last, c)))
+    r->out[r->length++] = ' ';
+  if (r->pending || !is_word (r->last))
+    r->number = c >= '0' && c <= '9';
+  r->out[r->length++] = c;
+  r->last = c;
+  r->pending = 0;
+  r->line_start = 0;
+}
+
+/* Identifier written just before the current position, if it's
+ *   a prefix of a raw string literal. */
+static int
+raw_prefix (struct reduction *r)
+{
+  static const char *const prefixes[] = { "R", "u8R", "uR", "UR", "LR" };
+  size_t start = r->length;
+  size_t i;
+
+  if (r->pending)
+    return 0;
+  while (start > 0 && is_word (r->out[start - 1]))
+    start--;
+  for (i = 0; i < sizeof prefixes / sizeof *prefixes; i++)
+    if (r->length - start == strlen (prefixes[i])
+        && memcmp (r->out + start, prefixes[i], r->length - start) == 0)
+      return 1;
+  return 0;
+}
+
+/* Copy R"delimiter( ... )delimiter" as is: lines aren't joined in it.
+ * Returns -1 if it's not a raw string after all. */
+static int
+copy_raw (struct reduction *r)
+{
+  const char *open = r->p + 1;
+  const char *close;
+  char terminator[20];
+  size_t n = 0;
+
+  while (open < r->end && *open != '(' && n < 16
+         && !is_space (*open) && *open != '\n' && *open != ')'
+         && *open != '\\')
+    terminator[1 + n++] = *open++;
+  if (open >= r->end || *open != '(')
+    return -1;
+  terminator[0] = ')';
+  terminator[1 + n] = '"';
+  terminator[2 + n] = '\0';
+
+  close = memmem (open, r->end - open, terminator, n + 2);
+  close = close ? close + n + 2 : r->end;
+  emit (r, '"');
+  memcpy (r->out + r->length, r->p + 1, close - r->p - 1);
+  r->length += close - r->p - 1;
+  r->last = '"';
+  r->p = close;
+  return 0;
+}
+
+/* Copy a character or string literal, up to the end of the line
+ *   if it's not terminated. */
+static void
+copy_literal (struct reduction *r, char quote)
+{
+  char c;
+
+  emit (r, quote);
+  while ((c = peek (r)) != '\0' && c != '\n')
+    {
+      r->out[r->length++] = next (r);
+      if (c == quote)
+        break;
+      if (c == '\\' && peek (r) != '\0' && peek (r) != '\n')
+        r->out[r->length++] = next (r);
+    }
+  r->last = r->out[r->length - 1];
+}
+
+static void
+reduce (struct reduction *r)
+{
+  char c;
+
+  while ((c = next (r)) != '\0')
+    if (c == '/' && peek (r) == '*')
+      {
+        next (r);
+        while ((c = next (r)) != '\0'
+               && !(c == '*' && peek (r) == '/'))
+          ;
+        next (r);
+        r->pending = 1;
+      }
+    else if (c == '/' && peek (r) == '/')
+      {
+        while (peek (r) != '\0' && peek (r) != '\n')
+          next (r);
+        r->pending = 1;
+      }
+    else if (c == '\n')
+      {
+        if (r->directive)
+          {
+            r->out[r->length++] = '\n';
+            r->last = '\0';
+            r->pending = 0;
+            r->directive = 0;
+          }
+        else
+          r->pending = 1;
+        r->line_start = 1;
+      }
+    else if (is_space (c))
+      r->pending = 1;
+    else if (c == '#' && r->line_start && !r->directive)
+      {
+        if (r->last)
+          r->out[r->length++] = '\n';
+        r->last = '\0';
+        r->pending = 0;
+        r->directive = 1;
+        emit (r, c);
+      }
+    else if (c == '\'' && r->number && !r->pending && is_word (peek (r)))
+      emit (r, c);
+    else if (c == '"' && raw_prefix (r))
+      {
+        r->p--;
+        if (copy_raw (r) < 0)
+          {
+            r->p++;
+            copy_literal (r, c);
+          }
+      }
+    else if (c == '"' || c == '\'')
+      copy_literal (r, c);
+    else
+      emit (r, c);
+}
+
+int
+qake_hash_code (const char *path, uint64_t *digest)
+{
+  struct stat st;
+  char *map;
+  struct reduction r;
+  int fd = open (path, O_RDONLY);
+
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (st.st_size == 0)
+    {
+      close (fd);
+      return qake_hash_file (path, digest);
+    }
+
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+    return -1;
+
+  memset (&r, 0, sizeof r);
+  r.p = map;
+  r.end = map + st.st_size;
+  r.line_start = 1;
+  /* At most a space before each character. */
+  r.out = malloc (2 * st.st_size + 1);
+  if (r.out == NULL)
+    {
+      munmap (map, st.st_size);
+      return -1;
+    }
+  reduce (&r);
+  munmap (map, st.st_size);
+
+  qake_count_hashed (st.st_size);
+  *digest = qake_xxh64 (r.out, r.length, 0);
+  free (r.out);
+  return 0;
+}
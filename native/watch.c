@@ -0,0 +1,1007 @@
+/*
+ * Build daemon: answers builds without starting Make when it can.
+ *
+ * Most runs of qake during editing find nothing to do, and still pay for
+ *   reading the Makefiles, the deps store and the hash store, and for
+ *   looking at every file of the graph. On a large tree, that's too much
+ *   for an editor running the build on each save.
+ * The daemon watches the project and qake itself with inotify, and keeps
+ *   the graph of the last successful build in memory: which objects are
+ *   compiled from which sources and headers, as the deps store lists them
+ *   (see DEPS_STORE in prologue.mk), and digests of these files as they
+ *   were built. Asked about a build with the same arguments, it answers:
+ *   - clean, if nothing changed since, or only files of the graph whose
+ *     contents are the same (touched, or saved without changes).
+ *     Make isn't started then;
+ *   - dirty, with the objects to compile, if files of the graph changed
+ *     and nothing else did. These are printed to standard error before
+ *     the build starts, a line 'DIRTY OBJECT' each, for an editor running
+ *     qake to show what's being compiled;
+ *   - dirty alone if anything else changed: a Makefile, a new source,
+ *     a file under the build directory. The daemon can't tell what that
+ *     means for the build.
+ *   Make runs as usual for a dirty build, and it's still Make that decides
+ *   what to build: the graph doesn't know what objects are linked into.
+ *
+ *   qake-watch --serve SOCKET BUILD_DIR DIRECTORY...
+ *     Watch the directories recursively (except .git ones), and answer
+ *     on the Unix socket SOCKET. Returns as soon as the socket is ready,
+ *     leaving the daemon in the background. The daemon exits when SOCKET
+ *     is removed: 'qake clean' stops it this way, and so does a new daemon
+ *     started for the same socket.
+ *   qake-watch --build SOCKET KEY -- COMMAND...
+ *     Ask the daemon whether the build with arguments KEY is up to date,
+ *     and run COMMAND unless it is, printing the objects to compile first,
+ *     if the daemon knows them. Without the daemon, COMMAND is just run.
+ *     Exits with the status of COMMAND.
+ *
+ * Changes under BUILD_DIR are what builds do, so they don't count while
+ *   a build runs. Otherwise they do: if you remove an object, Make has
+ *   to build it again.
+ * A successful build clears the changes made before it started. Changes
+ *   made while it runs (a source saved in the middle of the build) are
+ *   left for the next one. After it, the graph is read again if the deps
+ *   store changed, and files changed before the build are hashed again.
+ *
+ * The daemon can't see what's outside of the watched directories:
+ *   system headers, the compiler, variables in the environment.
+ *   Start it again (qake --daemon) after changing those.
+ *
+ * The protocol is a line per message:
+ *   client: build KEY      daemon: clean, dirty, or dirty OBJECT...
+ *   client: done STATUS    (after running the command, if it was dirty)
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "qake.h"
+
+#define MAX_CLIENTS 64
+#define MESSAGE_SIZE 8192
+
+static const uint32_t watch_mask =
+  IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF
+  | IN_MODIFY | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+/* Table of strings, by open addressing: size is a power of two. */
+struct table
+{
+  struct entry
+  {
+    char *key;
+    void *value;
+  } *entries;
+  size_t size;
+  size_t count;
+};
+
+/* A file of the graph: a source, or a header objects include. */
+struct node
+{
+  /* Digest of the file as the last successful build saw it. */
+  uint64_t digest;
+  int has_digest;
+  /* Changed since the last successful build. */
+  int changed;
+  /* Objects compiled from the file, by index into graph.objects. */
+  int *objects;
+  int objects_count;
+};
+
+struct graph
+{
+  /* Nodes by absolute path. Files outside of the watched directories
+   *   aren't there: no changes of theirs would be seen anyway. */
+  struct table files;
+  char **objects;
+  int objects_count;
+  /* The deps store the graph was read from, as it was then. */
+  struct timespec mtime;
+  ino_t ino;
+};
+
+struct client
+{
+  int fd;
+  size_t length;
+  char message[MESSAGE_SIZE];
+  /* The client runs a build for 'key'. */
+  int building;
+  char *key;
+  /* Something changed while it ran. */
+  int tainted;
+};
+
+static struct
+{
+  int inotify;
+  /* Watched directories, by watch descriptor. */
+  char **paths;
+  int paths_count;
+  const char *build_dir;
+  /* Watched directories and the deps store, absolute. */
+  char **roots;
+  int roots_count;
+  char *deps_store;
+  struct graph graph;
+  const char *socket_dir;
+  const char *socket_name;
+  struct client clients[MAX_CLIENTS];
+  int clients_count;
+  /* Builds running now. */
+  int building;
+  /* Something outside of the graph changed since the last successful
+   *   build, whose arguments were 'clean_key'. Changes of files
+   *   of the graph are marked in their' nodes. */
+  int dirty;
+  char *clean_key;
+} daemon_state;
+
+static char *
+join_path (const char *directory, const char *name)
+{
+  char *path = malloc (strlen (directory) + strlen (name) + 2);
+
+  sprintf (path, "%s/%s", directory, name);
+  return path;
+}
+
+static int
+is_under (const char *path, const char *directory)
+{
+  size_t n = strlen (directory);
+
+  return strncmp (path, directory, n) == 0
+    && (path[n] == '/' || path[n] == '\0');
+}
+
+/* Slot of the key in the table, added if 'add' is set.
+ * Returns NULL if the key isn't there, and isn't to be added. */
+static struct entry *
+table_find (struct table *table, const char *key, int add)
+{
+  size_t i;
+
+  if (add && (table->count + 1) * 2 > table->size)
+    {
+      struct table grown;
+
+      grown.size = table->size ? table->size * 2 : 1024;
+      grown.count = 0;
+      grown.entries = calloc (grown.size, sizeof *grown.entries);
+      for (i = 0; i < table->size; i++)
+        if (table->entries[i].key != NULL)
+          *table_find (&grown, table->entries[i].key, 1) = table->entries[i];
+      free (table->entries);
+      *table = grown;
+    }
+  if (table->size == 0)
+    return NULL;
+
+  i = qake_xxh64 (key, strlen (key), 0) & (table->size - 1);
+  while (table->entries[i].key != NULL)
+    {
+      if (strcmp (table->entries[i].key, key) == 0)
+        return &table->entries[i];
+      i = (i + 1) & (table->size - 1);
+    }
+  if (!add)
+    return NULL;
+  table->count++;
+  return &table->entries[i];
+}
+
+/* Free keys of the table, and values with 'free_value'. */
+static void
+table_free (struct table *table, void (*free_value) (void *))
+{
+  size_t i;
+
+  for (i = 0; i < table->size; i++)
+    if (table->entries[i].key != NULL)
+      {
+        free (table->entries[i].key);
+        if (free_value != NULL)
+          free_value (table->entries[i].value);
+      }
+  free (table->entries);
+  memset (table, 0, sizeof *table);
+}
+
+static void
+free_node (void *value)
+{
+  struct node *node = value;
+
+  free (node->objects);
+  free (node);
+}
+
+static struct node *
+find_node (const char *path)
+{
+  struct entry *entry = table_find (&daemon_state.graph.files, path, 0);
+
+  return entry != NULL ? entry->value : NULL;
+}
+
+/* Digest of contents of the file, XXH64 as in the hash store. */
+static int
+hash_file (const char *path, uint64_t *digest)
+{
+  struct stat st;
+  void *data;
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0)
+    return -1;
+  if (fstat (fd, &st) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  if (st.st_size == 0)
+    {
+      close (fd);
+      *digest = qake_xxh64 ("", 0, 0);
+      return 0;
+    }
+  data = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (data == MAP_FAILED)
+    return -1;
+  *digest = qake_xxh64 (data, st.st_size, 0);
+  munmap (data, st.st_size);
+  return 0;
+}
+
+/* Absolute path of the file named WORD in the deps store, or NULL if it's
+ *   outside of the watched directories. Only the directory is resolved,
+ *   as paths of events are made: by the directory watched, and the name.
+ *   Resolved directories are kept in DIRECTORIES. */
+static char *
+absolute_path (struct table *directories, const char *word)
+{
+  const char *slash = strrchr (word, '/');
+  char *directory = slash ? strndup (word, slash == word ? 1 : slash - word)
+    : strdup (".");
+  struct entry *entry = table_find (directories, directory, 1);
+  const char *resolved;
+
+  if (entry->key == NULL)
+    {
+      char *real = realpath (directory, NULL);
+      int i;
+
+      entry->key = directory;
+      entry->value = NULL;
+      for (i = 0; real != NULL && i < daemon_state.roots_count; i++)
+        if (is_under (real, daemon_state.roots[i]))
+          {
+            entry->value = real;
+            real = NULL;
+          }
+      free (real);
+    }
+  else
+    free (directory);
+
+  resolved = entry->value;
+  if (resolved == NULL)
+    return NULL;
+  return join_path (resolved, slash ? slash + 1 : word);
+}
+
+/* Read the deps store into the graph. Digests of the files known before
+ *   are kept, unless the files changed since. The latest record of
+ *   an object wins, so the records are read from the last one. */
+static void
+load_graph (void)
+{
+  struct graph graph;
+  struct table directories;
+  struct table seen;
+  struct stat st;
+  char *text;
+  char **lines = NULL;
+  size_t lines_count = 0;
+  size_t i;
+  ssize_t n;
+  int fd = open (daemon_state.deps_store, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    {
+      if (fd >= 0)
+        close (fd);
+      table_free (&daemon_state.graph.files, free_node);
+      return;
+    }
+  if (daemon_state.graph.files.count > 0
+      && st.st_ino == daemon_state.graph.ino
+      && st.st_mtim.tv_sec == daemon_state.graph.mtime.tv_sec
+      && st.st_mtim.tv_nsec == daemon_state.graph.mtime.tv_nsec)
+    {
+      close (fd);
+      return;
+    }
+
+  text = malloc (st.st_size + 1);
+  for (i = 0; i < (size_t) st.st_size; i += n)
+    if ((n = read (fd, text + i, st.st_size - i)) <= 0)
+      break;
+  close (fd);
+  text[i] = '\0';
+
+  /* Continued lines are joined. */
+  for (i = 0; text[i] != '\0'; i++)
+    if (text[i] == '\\' && text[i + 1] == '\n')
+      text[i] = text[i + 1] = ' ';
+  for (i = 0; text[i] != '\0'; i++)
+    if (i == 0 || text[i - 1] == '\n')
+      {
+        if ((lines_count & (lines_count - 1)) == 0)
+          lines = realloc (lines, (lines_count * 2 + 1) * sizeof *lines);
+        lines[lines_count++] = text + i;
+      }
+  for (i = 0; text[i] != '\0'; i++)
+    if (text[i] == '\n')
+      text[i] = '\0';
+
+  memset (&graph, 0, sizeof graph);
+  memset (&directories, 0, sizeof directories);
+  memset (&seen, 0, sizeof seen);
+  graph.mtime = st.st_mtim;
+  graph.ino = st.st_ino;
+  while (lines_count > 0)
+    {
+      char *line = lines[--lines_count];
+      char *assignment = strstr (line, ":=");
+      char *save = NULL;
+      char *word;
+      struct entry *entry;
+      int object;
+
+      if (strncmp (line, "QAKE_DEPS_", 10) != 0 || assignment == NULL)
+        continue;
+      *assignment = '\0';
+      entry = table_find (&seen, line + 10, 1);
+      if (entry->key != NULL)
+        continue;
+      entry->key = strdup (line + 10);
+
+      object = graph.objects_count++;
+      graph.objects = realloc (graph.objects,
+                               graph.objects_count * sizeof *graph.objects);
+      graph.objects[object] = strdup (line + 10);
+
+      for (word = strtok_r (assignment + 2, " \t", &save); word != NULL;
+           word = strtok_r (NULL, " \t", &save))
+        {
+          char *path = strcmp (word, ":") == 0 ? NULL
+            : absolute_path (&directories, word);
+          struct node *node;
+
+          if (path == NULL)
+            continue;
+          entry = table_find (&graph.files, path, 1);
+          if (entry->key == NULL)
+            {
+              struct node *old = find_node (path);
+
+              entry->key = path;
+              entry->value = node = calloc (1, sizeof *node);
+              if (old != NULL && old->has_digest && !old->changed)
+                {
+                  node->digest = old->digest;
+                  node->has_digest = 1;
+                }
+              else
+                node->changed = old != NULL && old->changed;
+            }
+          else
+            {
+              free (path);
+              node = entry->value;
+              if (node->objects_count > 0
+                  && node->objects[node->objects_count - 1] == object)
+                continue;
+            }
+          if ((node->objects_count & (node->objects_count - 1)) == 0)
+            node->objects = realloc (node->objects,
+                                     (node->objects_count * 2 + 1)
+                                     * sizeof *node->objects);
+          node->objects[node->objects_count++] = object;
+        }
+    }
+  free (lines);
+  free (text);
+  table_free (&seen, NULL);
+  table_free (&directories, free);
+
+  table_free (&daemon_state.graph.files, free_node);
+  for (i = 0; i < (size_t) daemon_state.graph.objects_count; i++)
+    free (daemon_state.graph.objects[i]);
+  free (daemon_state.graph.objects);
+  daemon_state.graph = graph;
+}
+
+/* Watch the directory and the ones under it. */
+static void
+watch_tree (const char *path)
+{
+  DIR *directory;
+  struct dirent *entry;
+  int wd = inotify_add_watch (daemon_state.inotify, path, watch_mask);
+
+  if (wd < 0)
+    {
+      /* Without a watch, changes would go unnoticed. */
+      if (errno == ENOSPC || errno == ENOMEM)
+        {
+          fprintf (stderr, "qake-watch: %s: %s"
+                   " (see /proc/sys/fs/inotify/max_user_watches)\n",
+                   path, strerror (errno));
+          exit (1);
+        }
+      return;
+    }
+
+  if (wd >= daemon_state.paths_count)
+    {
+      int count = wd * 2 + 16;
+
+      daemon_state.paths = realloc (daemon_state.paths,
+                                    count * sizeof *daemon_state.paths);
+      memset (daemon_state.paths + daemon_state.paths_count, 0,
+              (count - daemon_state.paths_count)
+              * sizeof *daemon_state.paths);
+      daemon_state.paths_count = count;
+    }
+  free (daemon_state.paths[wd]);
+  daemon_state.paths[wd] = strdup (path);
+
+  directory = opendir (path);
+  if (directory == NULL)
+    return;
+  while ((entry = readdir (directory)) != NULL)
+    {
+      char *child;
+      struct stat st;
+
+      if (strcmp (entry->d_name, ".") == 0
+          || strcmp (entry->d_name, "..") == 0
+          || strcmp (entry->d_name, ".git") == 0)
+        continue;
+      child = join_path (path, entry->d_name);
+      if (entry->d_type == DT_DIR
+          || (entry->d_type == DT_UNKNOWN && lstat (child, &st) == 0
+              && S_ISDIR (st.st_mode)))
+        watch_tree (child);
+      free (child);
+    }
+  closedir (directory);
+}
+
+/* Something changed at PATH: the node of the file, if it's in the graph,
+ *   or the whole state otherwise. Builds running now don't see it. */
+static void
+mark_changed (const char *path)
+{
+  struct node *node = path != NULL ? find_node (path) : NULL;
+  int i;
+
+  if (node != NULL)
+    node->changed = 1;
+  else
+    daemon_state.dirty = 1;
+  for (i = 0; i < daemon_state.clients_count; i++)
+    daemon_state.clients[i].tainted = 1;
+}
+
+static void
+handle_event (const struct inotify_event *event)
+{
+  const char *directory;
+  char *path;
+
+  if (event->mask & IN_Q_OVERFLOW)
+    {
+      mark_changed (NULL);
+      return;
+    }
+  if (event->wd < 0 || event->wd >= daemon_state.paths_count
+      || daemon_state.paths[event->wd] == NULL)
+    return;
+  directory = daemon_state.paths[event->wd];
+
+  if (event->mask & IN_IGNORED)
+    {
+      free (daemon_state.paths[event->wd]);
+      daemon_state.paths[event->wd] = NULL;
+      return;
+    }
+
+  if (strcmp (directory, daemon_state.socket_dir) == 0
+      && ((event->mask & (IN_DELETE_SELF | IN_MOVE_SELF))
+          || ((event->mask & (IN_DELETE | IN_MOVED_FROM))
+              && strcmp (event->name, daemon_state.socket_name) == 0)))
+    exit (0);
+
+  path = event->len > 0 ? join_path (directory, event->name)
+    : strdup (directory);
+  if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))
+      && strcmp (event->name, ".git") != 0)
+    watch_tree (path);
+  if (!(daemon_state.building > 0
+        && is_under (path, daemon_state.build_dir)))
+    mark_changed ((event->mask & IN_ISDIR) ? NULL : path);
+  free (path);
+}
+
+/* Handle the events queued so far. */
+static void
+read_events (void)
+{
+  char buffer[64 * 1024]
+    __attribute__ ((aligned (__alignof__ (struct inotify_event))));
+  ssize_t n;
+
+  while ((n = read (daemon_state.inotify, buffer, sizeof buffer)) > 0)
+    {
+      char *p = buffer;
+
+      while (p < buffer + n)
+        {
+          const struct inotify_event *event =
+            (const struct inotify_event *) p;
+
+          handle_event (event);
+          p += sizeof *event + event->len;
+        }
+    }
+}
+
+static void
+reply (struct client *client, const char *line)
+{
+  size_t length = strlen (line);
+  ssize_t n;
+
+  /* A long list of objects may not go at once. */
+  while (length > 0 && (n = write (client->fd, line, length)) > 0)
+    {
+      line += n;
+      length -= n;
+    }
+  /* If the client is gone, we'll see it closed. */
+}
+
+/* Answer to a build with the arguments of the last successful one:
+ *   "clean", "dirty" with the objects compiled from the files changed
+ *   since, or just "dirty" if it's not known what changed.
+ * Files whose contents are the same as built aren't changed anymore. */
+static char *
+answer (void)
+{
+  struct table *files = &daemon_state.graph.files;
+  char *objects = NULL;
+  size_t length = 0;
+  char *marked;
+  size_t i;
+  int j;
+
+  if (daemon_state.dirty)
+    return strdup ("dirty\n");
+
+  marked = calloc (daemon_state.graph.objects_count + 1, 1);
+  for (i = 0; i < files->size; i++)
+    {
+      struct node *node = files->entries[i].value;
+      uint64_t digest;
+
+      if (files->entries[i].key == NULL || !node->changed)
+        continue;
+      if (!node->has_digest
+          || hash_file (files->entries[i].key, &digest) < 0)
+        {
+          free (marked);
+          return strdup ("dirty\n");
+        }
+      if (digest == node->digest)
+        {
+          node->changed = 0;
+          continue;
+        }
+      for (j = 0; j < node->objects_count; j++)
+        marked[node->objects[j]] = 1;
+    }
+
+  for (j = 0; j < daemon_state.graph.objects_count; j++)
+    if (marked[j])
+      {
+        const char *name = daemon_state.graph.objects[j];
+
+        objects = realloc (objects, length + strlen (name) + 2);
+        objects[length++] = ' ';
+        strcpy (objects + length, name);
+        length += strlen (name);
+      }
+  free (marked);
+  if (objects == NULL)
+    return strdup ("clean\n");
+  {
+    char *line = malloc (length + sizeof "dirty\n");
+
+    sprintf (line, "dirty%s\n", objects);
+    free (objects);
+    return line;
+  }
+}
+
+/* The build ended well, and nothing changed while it ran: what changed
+ *   before is built now. Files not hashed yet are hashed for the next
+ *   time they change. */
+static void
+mark_built (void)
+{
+  struct table *files = &daemon_state.graph.files;
+  size_t i;
+
+  daemon_state.dirty = 0;
+  load_graph ();
+  for (i = 0; i < files->size; i++)
+    {
+      struct node *node = files->entries[i].value;
+
+      if (files->entries[i].key == NULL
+          || (node->has_digest && !node->changed))
+        continue;
+      node->has_digest = hash_file (files->entries[i].key,
+                                    &node->digest) == 0;
+      node->changed = 0;
+    }
+}
+
+static void
+handle_message (struct client *client, char *message)
+{
+  /* Changes made before the message must be taken into account. */
+  read_events ();
+
+  if (strncmp (message, "build ", 6) == 0 && !client->building)
+    {
+      const char *key = message + 6;
+      char *line;
+
+      if (daemon_state.building == 0 && daemon_state.clean_key != NULL
+          && strcmp (key, daemon_state.clean_key) == 0)
+        line = answer ();
+      else
+        line = strdup ("dirty\n");
+      if (strcmp (line, "clean\n") != 0)
+        {
+          client->building = 1;
+          client->tainted = 0;
+          free (client->key);
+          client->key = strdup (key);
+          daemon_state.building++;
+        }
+      reply (client, line);
+      free (line);
+    }
+  else if (strncmp (message, "done ", 5) == 0 && client->building)
+    {
+      client->building = 0;
+      daemon_state.building--;
+      if (atoi (message + 5) == 0 && !client->tainted)
+        {
+          mark_built ();
+          free (daemon_state.clean_key);
+          daemon_state.clean_key = client->key;
+          client->key = NULL;
+        }
+    }
+}
+
+static void
+close_client (int i)
+{
+  struct client *client = &daemon_state.clients[i];
+
+  if (client->building)
+    daemon_state.building--;
+  free (client->key);
+  close (client->fd);
+  *client = daemon_state.clients[--daemon_state.clients_count];
+}
+
+/* Read what the client sent. Returns -1 when it's gone. */
+static int
+read_client (struct client *client)
+{
+  ssize_t n = read (client->fd, client->message + client->length,
+                    MESSAGE_SIZE - 1 - client->length);
+  char *line;
+  char *newline;
+
+  if (n <= 0)
+    return -1;
+  client->length += n;
+  client->message[client->length] = '\0';
+
+  line = client->message;
+  while ((newline = strchr (line, '\n')) != NULL)
+    {
+      *newline = '\0';
+      handle_message (client, line);
+      line = newline + 1;
+    }
+  client->length -= line - client->message;
+  memmove (client->message, line, client->length);
+  /* A line which doesn't fit is not ours. */
+  return client->length < MESSAGE_SIZE - 1 ? 0 : -1;
+}
+
+static int
+serve (const char *socket_path, const char *build_dir,
+       char **directories, int count)
+{
+  struct sockaddr_un address;
+  struct pollfd fds[2 + MAX_CLIENTS];
+  char *socket_copy = strdup (socket_path);
+  char *slash;
+  int listener;
+  int i;
+
+  memset (&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof address.sun_path)
+    {
+      fprintf (stderr, "qake-watch: %s: path is too long\n", socket_path);
+      return 1;
+    }
+  strcpy (address.sun_path, socket_path);
+
+  /* Paths of events are absolute. */
+  slash = strrchr (socket_copy, '/');
+  daemon_state.socket_name = slash ? slash + 1 : socket_copy;
+  if (slash)
+    *slash = '\0';
+  daemon_state.socket_dir = realpath (slash ? socket_copy : ".", NULL);
+  if (daemon_state.socket_dir == NULL)
+    {
+      fprintf (stderr, "qake-watch: %s: %s\n", socket_path, strerror (errno));
+      return 1;
+    }
+  daemon_state.build_dir = realpath (build_dir, NULL);
+  if (daemon_state.build_dir == NULL)
+    {
+      fprintf (stderr, "qake-watch: %s: %s\n", build_dir, strerror (errno));
+      return 1;
+    }
+
+  daemon_state.inotify = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+  if (daemon_state.inotify < 0)
+    {
+      fprintf (stderr, "qake-watch: inotify: %s\n", strerror (errno));
+      return 1;
+    }
+  daemon_state.roots = calloc (count, sizeof *daemon_state.roots);
+  for (i = 0; i < count; i++)
+    {
+      char *directory = realpath (directories[i], NULL);
+
+      if (directory != NULL)
+        {
+          watch_tree (directory);
+          daemon_state.roots[daemon_state.roots_count++] = directory;
+        }
+    }
+  daemon_state.deps_store = join_path (daemon_state.build_dir, "aux/deps.mk");
+  daemon_state.dirty = 1;
+
+  /* The daemon serving this socket before, if any, exits now. */
+  unlink (socket_path);
+  listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0
+      || bind (listener, (struct sockaddr *) &address, sizeof address) < 0
+      || listen (listener, MAX_CLIENTS) < 0)
+    {
+      fprintf (stderr, "qake-watch: %s: %s\n", socket_path, strerror (errno));
+      return 1;
+    }
+
+  switch (fork ())
+    {
+    case -1:
+      fprintf (stderr, "qake-watch: fork: %s\n", strerror (errno));
+      return 1;
+    case 0:
+      break;
+    default:
+      return 0;
+    }
+  setsid ();
+  signal (SIGPIPE, SIG_IGN);
+  i = open ("/dev/null", O_RDWR);
+  dup2 (i, 0);
+  dup2 (i, 1);
+  dup2 (i, 2);
+  if (i > 2)
+    close (i);
+
+  for (;;)
+    {
+      int n = 0;
+
+      fds[n].fd = listener;
+      fds[n++].events = POLLIN;
+      fds[n].fd = daemon_state.inotify;
+      fds[n++].events = POLLIN;
+      for (i = 0; i < daemon_state.clients_count; i++)
+        {
+          fds[n].fd = daemon_state.clients[i].fd;
+          fds[n++].events = POLLIN;
+        }
+      if (poll (fds, n, -1) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          return 1;
+        }
+
+      if (fds[1].revents)
+        read_events ();
+      /* Clients are handled from the last one, so that closing one
+       *   doesn't move the ones not handled yet. */
+      for (i = n - 1; i >= 2; i--)
+        if (fds[i].revents && read_client (&daemon_state.clients[i - 2]) < 0)
+          close_client (i - 2);
+      if (fds[0].revents)
+        {
+          int fd = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+
+          if (fd >= 0 && daemon_state.clients_count < MAX_CLIENTS)
+            {
+              struct client *client =
+                &daemon_state.clients[daemon_state.clients_count++];
+
+              memset (client, 0, sizeof *client);
+              client->fd = fd;
+            }
+          else if (fd >= 0)
+            close (fd);
+        }
+    }
+}
+
+static int
+run (char **command)
+{
+  int status;
+  pid_t pid = fork ();
+  struct sigaction ignore, old_int, old_quit;
+
+  if (pid < 0)
+    {
+      fprintf (stderr, "qake-watch: fork: %s\n", strerror (errno));
+      return 1;
+    }
+  if (pid == 0)
+    {
+      execvp (command[0], command);
+      fprintf (stderr, "qake-watch: %s: %s\n", command[0], strerror (errno));
+      _exit (127);
+    }
+
+  /* Ctrl-C stops the command, and we report how it ended, as system()
+   *   does. */
+  memset (&ignore, 0, sizeof ignore);
+  ignore.sa_handler = SIG_IGN;
+  sigaction (SIGINT, &ignore, &old_int);
+  sigaction (SIGQUIT, &ignore, &old_quit);
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return 1;
+  sigaction (SIGINT, &old_int, NULL);
+  sigaction (SIGQUIT, &old_quit, NULL);
+
+  if (WIFEXITED (status))
+    return WEXITSTATUS (status);
+  return 128 + WTERMSIG (status);
+}
+
+static int
+build (const char *socket_path, const char *key, char **command)
+{
+  struct sockaddr_un address;
+  char message[MESSAGE_SIZE];
+  char *line = NULL;
+  size_t length = 0;
+  ssize_t n = 0;
+  size_t i;
+  int status;
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  memset (&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  strncpy (address.sun_path, socket_path, sizeof address.sun_path - 1);
+  snprintf (message, sizeof message, "build %s\n", key);
+  for (i = 0; i + 1 < strlen (message); i++)
+    if (message[i] == '\n')
+      message[i] = ' ';
+
+  if (fd >= 0
+      && connect (fd, (struct sockaddr *) &address, sizeof address) == 0
+      && write (fd, message, strlen (message)) >= 0)
+    /* The answer is a line, however long the list of objects is. */
+    do
+      {
+        line = realloc (line, length + MESSAGE_SIZE + 1);
+        n = read (fd, line + length, MESSAGE_SIZE);
+        if (n > 0)
+          length += n;
+      }
+    while (n > 0 && line[length - 1] != '\n');
+  if (length == 0 || line[length - 1] != '\n')
+    {
+      free (line);
+      if (fd >= 0)
+        close (fd);
+      return run (command);
+    }
+  line[length - 1] = '\0';
+  if (strcmp (line, "clean") == 0)
+    return 0;
+  if (strncmp (line, "dirty ", 6) == 0)
+    {
+      char *save = NULL;
+      char *object;
+
+      for (object = strtok_r (line + 6, " ", &save); object != NULL;
+           object = strtok_r (NULL, " ", &save))
+        fprintf (stderr, "DIRTY %s\n", object);
+    }
+  free (line);
+
+  signal (SIGPIPE, SIG_IGN);
+  status = run (command);
+  snprintf (message, sizeof message, "done %d\n", status);
+  if (write (fd, message, strlen (message)) < 0)
+    {
+      /* The daemon is gone: there's no one to tell. */
+    }
+  close (fd);
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc >= 5 && strcmp (argv[1], "--serve") == 0)
+    return serve (argv[2], argv[3], argv + 4, argc - 4);
+  if (argc >= 6 && strcmp (argv[1], "--build") == 0
+      && strcmp (argv[4], "--") == 0)
+    return build (argv[2], argv[3], argv + 5);
+
+  fprintf (stderr, "Usage: qake-watch --serve SOCKET BUILD_DIR DIRECTORY...\n"
+           "       qake-watch --build SOCKET KEY -- COMMAND...\n");
+  return 2;
+}
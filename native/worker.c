@@ -0,0 +1,1349 @@
+/*
+ * Compile worker: a pool of processes running compilers for builds.
+ *
+ * A compile is shipped to the pool as data, not as a command line naming
+ *   files: the client preprocesses the source itself, sends the result
+ *   by its' hash (only if the pool doesn't have it yet), and gets the
+ *   object back by its' hash. The pool needs no access to the project,
+ *   its' headers or its' build directory, so the same protocol works
+ *   with a pool on another host: a socket forwarded there, say with
+ *   'ssh -L', is all it takes. The pool runs the compiler directly,
+ *   without a shell, and stays up between builds.
+ *
+ *   qake-worker --serve SOCKET STORE [--jobs N] [--idle SECONDS]
+ *               [--store-size MEGABYTES] [--compiler NAME]...
+ *     Start the pool on the Unix socket SOCKET, unless one already
+ *     answers there. Returns as soon as the socket is ready, leaving
+ *     the pool in the background. N processes serve the socket (the number
+ *     of cores by default). They keep what they were sent and what they
+ *     compiled in a directory of their' own under STORE, so what's sent
+ *     once isn't sent again. When it takes more than MEGABYTES (1024
+ *     by default), the files used the least recently are removed.
+ *     Only the compilers NAME are run (gcc and g++ by default), and not
+ *     with options making them run or load other programs (-wrapper, -B,
+ *     -fplugin and the like): whoever reaches the socket may use the pool.
+ *     The pool exits when it wasn't used for SECONDS (600 by default),
+ *     or when SOCKET is removed: 'qake clean' stops it this way.
+ *     Its' directory is removed then.
+ *   qake-worker --compile SOCKET -- COMMAND...
+ *     Run the compiler command COMMAND on the pool. Commands the pool
+ *     can't run (not compiling a single C or C++ source with -c and -o,
+ *     or choosing the language with -x) are run here, and so is anything
+ *     when there's no pool, or when the pool refuses it. Dependency files (-MD and the like) are written
+ *     here, by the preprocessor. Exits with the status of the compiler.
+ *
+ * Options of the preprocessor (-I, -D, -include and the like) are used
+ *   here and aren't sent: preprocessed source doesn't need them. That's
+ *   why precompiled headers don't help compiles run by the pool.
+ * The object refers to the pool's directory as the one it was compiled
+ *   in; debugging info is mapped back to the directory of the client
+ *   with -fdebug-prefix-map.
+ *
+ * Messages are frames: a header line 'VERB ARGUMENT LENGTH', followed
+ *   by LENGTH bytes of payload. Hashes are XXH64 of contents, in hex.
+ *   client: DIR - n <directory>   pool: (nothing)
+ *   client: HAVE HASH 0           pool: YES HASH 0, or NO HASH 0
+ *   client: PUT HASH n <contents> pool: YES HASH 0
+ *   client: COMPILE HASH n <arguments, each ending with a '\0'>
+ *                                 pool: STDERR - n <output of compiler>
+ *                                       DONE STATUS n <hash of object>
+ *   client: GET HASH 0            pool: BLOB HASH n <contents>, or NO HASH 0
+ * Anything else is answered with ERROR - n <message>, and the connection
+ *   is closed.
+ */
+
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "qake.h"
+
+#define HEADER_SIZE 128
+#define MAX_PAYLOAD (1UL << 30)
+#define HASH_SIZE 16
+
+/* A growing buffer, for payloads and output of processes. */
+struct buffer
+{
+  char *data;
+  size_t length;
+  size_t size;
+};
+
+/* One end of a connection. Reads are buffered, writes aren't. */
+struct connection
+{
+  int fd;
+  char buffer[65536];
+  size_t start;
+  size_t end;
+};
+
+struct frame
+{
+  char verb[16];
+  char argument[HEADER_SIZE];
+  struct buffer payload;
+};
+
+static void
+buffer_append (struct buffer *buffer, const void *data, size_t length)
+{
+  if (buffer->length + length + 1 > buffer->size)
+    {
+      size_t size = buffer->size ? buffer->size : 4096;
+
+      while (buffer->length + length + 1 > size)
+        size *= 2;
+      buffer->data = realloc (buffer->data, size);
+      if (buffer->data == NULL)
+        {
+          fprintf (stderr, "qake-worker: out of memory\n");
+          exit (1);
+        }
+      buffer->size = size;
+    }
+  memcpy (buffer->data + buffer->length, data, length);
+  buffer->length += length;
+  buffer->data[buffer->length] = '\0';
+}
+
+static void
+hash_hex (const void *data, size_t length, char *hex)
+{
+  snprintf (hex, HASH_SIZE + 1, "%016" PRIx64, qake_xxh64 (data, length, 0));
+}
+
+/* A hash is all we let clients name files in the store with. */
+static int
+is_hash (const char *s)
+{
+  size_t n = strspn (s, "0123456789abcdef");
+
+  return n == HASH_SIZE && s[n] == '\0';
+}
+
+static int
+write_all (int fd, const void *data, size_t length)
+{
+  const char *p = data;
+
+  while (length > 0)
+    {
+      ssize_t n = write (fd, p, length);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      p += n;
+      length -= n;
+    }
+  return 0;
+}
+
+/* Read everything from fd until the end of file. */
+static int
+read_all (int fd, struct buffer *buffer)
+{
+  char chunk[65536];
+
+  for (;;)
+    {
+      ssize_t n = read (fd, chunk, sizeof chunk);
+
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        return -1;
+      if (n == 0)
+        return 0;
+      buffer_append (buffer, chunk, n);
+    }
+}
+
+static int
+read_file (const char *path, struct buffer *buffer)
+{
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  int result;
+
+  if (fd < 0)
+    return -1;
+  result = read_all (fd, buffer);
+  close (fd);
+  return result;
+}
+
+/* Write the file under a temporary name and rename it: whoever looks at
+ *   it sees either nothing or all of it. */
+static int
+write_file (const char *path, const void *data, size_t length)
+{
+  char *temporary;
+  int fd;
+
+  if (asprintf (&temporary, "%s.XXXXXX", path) < 0)
+    return -1;
+  fd = mkstemp (temporary);
+  if (fd < 0)
+    {
+      free (temporary);
+      return -1;
+    }
+  if (write_all (fd, data, length) < 0 || fchmod (fd, 0644) < 0
+      || close (fd) < 0 || rename (temporary, path) < 0)
+    {
+      unlink (temporary);
+      free (temporary);
+      return -1;
+    }
+  free (temporary);
+  return 0;
+}
+
+static void
+make_directories (const char *path)
+{
+  char *copy = strdup (path);
+  char *p;
+
+  for (p = copy + 1; *p; p++)
+    if (*p == '/')
+      {
+        *p = '\0';
+        mkdir (copy, 0777);
+        *p = '/';
+      }
+  mkdir (copy, 0777);
+  free (copy);
+}
+
+static int
+fill (struct connection *connection)
+{
+  ssize_t n;
+
+  if (connection->start > 0)
+    {
+      memmove (connection->buffer, connection->buffer + connection->start,
+               connection->end - connection->start);
+      connection->end -= connection->start;
+      connection->start = 0;
+    }
+  do
+    n = read (connection->fd, connection->buffer + connection->end,
+              sizeof connection->buffer - connection->end);
+  while (n < 0 && errno == EINTR);
+  if (n <= 0)
+    return -1;
+  connection->end += n;
+  return 0;
+}
+
+/* Returns -1 at the end of the connection, or if the frame is malformed. */
+static int
+read_frame (struct connection *connection, struct frame *frame)
+{
+  char header[HEADER_SIZE];
+  char *newline;
+  size_t length;
+  unsigned long payload_length;
+
+  for (;;)
+    {
+      newline = memchr (connection->buffer + connection->start, '\n',
+                        connection->end - connection->start);
+      if (newline != NULL)
+        break;
+      if (connection->end - connection->start >= HEADER_SIZE
+          || fill (connection) < 0)
+        return -1;
+    }
+  length = newline - (connection->buffer + connection->start);
+  if (length >= HEADER_SIZE)
+    return -1;
+  memcpy (header, connection->buffer + connection->start, length);
+  header[length] = '\0';
+  connection->start += length + 1;
+
+  if (sscanf (header, "%15s %127s %lu", frame->verb, frame->argument,
+              &payload_length) != 3
+      || payload_length > MAX_PAYLOAD)
+    return -1;
+
+  frame->payload.length = 0;
+  while (frame->payload.length < payload_length)
+    {
+      size_t available = connection->end - connection->start;
+      size_t wanted = payload_length - frame->payload.length;
+
+      if (available == 0)
+        {
+          if (fill (connection) < 0)
+            return -1;
+          continue;
+        }
+      if (available > wanted)
+        available = wanted;
+      buffer_append (&frame->payload, connection->buffer + connection->start,
+                     available);
+      connection->start += available;
+    }
+  if (frame->payload.data == NULL)
+    buffer_append (&frame->payload, "", 0);
+  return 0;
+}
+
+static int
+write_frame (int fd, const char *verb, const char *argument,
+             const void *payload, size_t length)
+{
+  char header[HEADER_SIZE];
+  int n = snprintf (header, sizeof header, "%s %s %zu\n", verb, argument,
+                    length);
+
+  if (n < 0 || (size_t) n >= sizeof header)
+    return -1;
+  if (write_all (fd, header, n) < 0)
+    return -1;
+  return write_all (fd, payload, length);
+}
+
+/* The pool. */
+
+static struct
+{
+  const char *socket_path;
+  /* Identity of the socket we made: it's gone when the path is removed,
+   *   or taken by another pool. */
+  dev_t socket_dev;
+  ino_t socket_ino;
+  char *store;
+  /* The store is kept under this many bytes. */
+  uint64_t store_limit;
+  /* Compilers the clients may run, ending with NULL. */
+  char **compilers;
+  unsigned idle;
+  /* When the pool was used the last time, shared by its' processes. */
+  volatile time_t *last_used;
+  /* Bytes in the store, as far as its' processes know. */
+  uint64_t *store_size;
+} pool;
+
+static int
+socket_is_ours (void)
+{
+  struct stat st;
+
+  return stat (pool.socket_path, &st) == 0 && st.st_dev == pool.socket_dev
+    && st.st_ino == pool.socket_ino;
+}
+
+static char *
+store_path (const char *name)
+{
+  char *path;
+
+  if (asprintf (&path, "%s/%s", pool.store, name) < 0)
+    return NULL;
+  return path;
+}
+
+/* Mark the file of the store as used now, if it's there: it's the last
+ *   one to be evicted then. */
+static int
+store_use (const char *path)
+{
+  return utimensat (AT_FDCWD, path, NULL, 0);
+}
+
+/* A file of the store, as eviction sees it. */
+struct stored
+{
+  char *name;
+  struct timespec used;
+  off_t size;
+};
+
+static int
+compare_stored (const void *a, const void *b)
+{
+  const struct stored *x = a;
+  const struct stored *y = b;
+
+  if (x->used.tv_sec != y->used.tv_sec)
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  if (x->used.tv_nsec != y->used.tv_nsec)
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+  return 0;
+}
+
+/* Remove the least recently used inputs and objects, until the store
+ *   takes three quarters of its' limit: so it's not looked through
+ *   again on the next addition. Jobs have links of their' own to their'
+ *   inputs, so a running compiler doesn't lose its' one. */
+static void
+evict (void)
+{
+  DIR *directory = opendir (pool.store);
+  struct stored *files = NULL;
+  struct dirent *entry;
+  size_t count = 0;
+  size_t size = 0;
+  size_t i;
+  uint64_t total = 0;
+
+  if (directory == NULL)
+    return;
+  while ((entry = readdir (directory)) != NULL)
+    {
+      struct stat st;
+
+      if (!is_hash (entry->d_name)
+          || fstatat (dirfd (directory), entry->d_name, &st, 0) < 0
+          || !S_ISREG (st.st_mode))
+        continue;
+      if (count == size)
+        {
+          struct stored *more;
+
+          size = size ? size * 2 : 256;
+          more = realloc (files, size * sizeof *files);
+          if (more == NULL)
+            break;
+          files = more;
+        }
+      files[count].name = strdup (entry->d_name);
+      files[count].used = st.st_mtim;
+      files[count].size = st.st_size;
+      total += st.st_size;
+      count++;
+    }
+  closedir (directory);
+
+  qsort (files, count, sizeof *files, compare_stored);
+  for (i = 0; i < count; i++)
+    {
+      if (total > pool.store_limit / 4 * 3 && files[i].name != NULL)
+        {
+          char *path = store_path (files[i].name);
+
+          if (path != NULL && unlink (path) == 0)
+            total -= files[i].size;
+          free (path);
+        }
+      free (files[i].name);
+    }
+  free (files);
+  __atomic_store_n (pool.store_size, total, __ATOMIC_RELAXED);
+}
+
+/* Count a file added to the store, evicting if it's over the limit.
+ * One process evicts at a time: the lock goes away with the process,
+ *   if it's killed. */
+static void
+store_added (uint64_t size)
+{
+  int fd;
+
+  if (__atomic_add_fetch (pool.store_size, size, __ATOMIC_RELAXED)
+      <= pool.store_limit)
+    return;
+  fd = open (pool.store, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  if (flock (fd, LOCK_EX | LOCK_NB) == 0)
+    evict ();
+  close (fd);
+}
+
+/* Put the contents named by their' hash into the store, unless they're
+ *   there already. */
+static int
+store_put (const char *path, const void *data, size_t length)
+{
+  if (store_use (path) == 0)
+    return 0;
+  if (write_file (path, data, length) < 0)
+    return -1;
+  store_added (length);
+  return 0;
+}
+
+/* Returns why the pool won't run the arguments of COMPILE, or NULL.
+ * Only the compilers given are run, and without options making them
+ *   run or load other programs, or read options from files. */
+static const char *
+refusal (const struct buffer *arguments)
+{
+  static const char *const refused[] = {
+    "-wrapper", "-B", "-fplugin", "-specs", "--specs", "-o", "@", NULL
+  };
+  static char message[HEADER_SIZE + 64];
+  const char *const *prefix;
+  const char *p;
+  char **compiler;
+
+  if (arguments->length == 0)
+    return "qake-worker: no compiler\n";
+  for (compiler = pool.compilers; *compiler; compiler++)
+    if (strcmp (arguments->data, *compiler) == 0)
+      break;
+  if (*compiler == NULL)
+    {
+      snprintf (message, sizeof message,
+                "qake-worker: %.*s: not an allowed compiler\n",
+                HEADER_SIZE, arguments->data);
+      return message;
+    }
+  for (p = arguments->data + strlen (arguments->data) + 1;
+       p < arguments->data + arguments->length; p += strlen (p) + 1)
+    for (prefix = refused; *prefix; prefix++)
+      if (strncmp (p, *prefix, strlen (*prefix)) == 0)
+        {
+          snprintf (message, sizeof message,
+                    "qake-worker: %.*s: not allowed on the pool\n",
+                    HEADER_SIZE, p);
+          return message;
+        }
+  return NULL;
+}
+
+/* Run the compiler in a directory of its' own, on the input from
+ *   the store, and put the object into the store. */
+static int
+compile (struct connection *connection, const char *input,
+         const struct buffer *arguments, const char *client_directory)
+{
+  struct buffer output = { NULL, 0, 0 };
+  struct buffer object = { NULL, 0, 0 };
+  char object_hash[HASH_SIZE + 1] = "";
+  char status_text[16];
+  char *directory = store_path ("job.XXXXXX");
+  char *input_path = store_path (input);
+  char *job_input = NULL;
+  char *object_path = NULL;
+  char *prefix_map = NULL;
+  char **argv;
+  size_t count = 0;
+  size_t i;
+  int pipe_fds[2];
+  int status = 1;
+  pid_t pid;
+  const char *p;
+
+  for (p = arguments->data; p < arguments->data + arguments->length;
+       p += strlen (p) + 1)
+    count++;
+  argv = calloc (count + 7, sizeof *argv);
+  if (directory == NULL || input_path == NULL || argv == NULL
+      || count == 0 || mkdtemp (directory) == NULL
+      || asprintf (&job_input, "%s/input", directory) < 0
+      || link (input_path, job_input) < 0
+      || asprintf (&object_path, "%s/object.o", directory) < 0
+      || asprintf (&prefix_map, "-fdebug-prefix-map=%s=%s", directory,
+                   client_directory ? client_directory : ".") < 0
+      || pipe2 (pipe_fds, O_CLOEXEC) < 0)
+    {
+      const char message[] = "qake-worker: can't prepare the job\n";
+
+      write_frame (connection->fd, "ERROR", "-", message, sizeof message - 1);
+      if (job_input != NULL)
+        unlink (job_input);
+      if (directory != NULL)
+        rmdir (directory);
+      free (directory);
+      free (input_path);
+      free (job_input);
+      free (object_path);
+      free (prefix_map);
+      free (argv);
+      return -1;
+    }
+  /* The job has its' own link to the input, in case it's evicted. */
+
+  i = 0;
+  for (p = arguments->data; p < arguments->data + arguments->length;
+       p += strlen (p) + 1)
+    argv[i++] = (char *) p;
+  if (client_directory != NULL)
+    argv[i++] = prefix_map;
+  argv[i++] = "-c";
+  argv[i++] = job_input;
+  argv[i++] = "-o";
+  argv[i++] = object_path;
+  argv[i] = NULL;
+
+  pid = fork ();
+  if (pid == 0)
+    {
+      dup2 (pipe_fds[1], 1);
+      dup2 (pipe_fds[1], 2);
+      if (chdir (directory) < 0)
+        _exit (127);
+      execvp (argv[0], argv);
+      fprintf (stderr, "qake-worker: %s: %s\n", argv[0], strerror (errno));
+      _exit (127);
+    }
+  close (pipe_fds[1]);
+  if (pid > 0)
+    {
+      read_all (pipe_fds[0], &output);
+      while (waitpid (pid, &status, 0) < 0 && errno == EINTR)
+        ;
+      status = WIFEXITED (status) ? WEXITSTATUS (status)
+        : 128 + WTERMSIG (status);
+    }
+  close (pipe_fds[0]);
+
+  if (status == 0 && read_file (object_path, &object) == 0)
+    {
+      char *path;
+
+      hash_hex (object.data, object.length, object_hash);
+      path = store_path (object_hash);
+      if (path == NULL || store_put (path, object.data, object.length) < 0)
+        {
+          object_hash[0] = '\0';
+          status = 1;
+        }
+      free (path);
+    }
+  else if (status == 0)
+    status = 1;
+  unlink (object_path);
+  unlink (job_input);
+  rmdir (directory);
+
+  snprintf (status_text, sizeof status_text, "%d", status);
+  status = write_frame (connection->fd, "STDERR", "-", output.data,
+                        output.length) < 0
+    || write_frame (connection->fd, "DONE", status_text, object_hash,
+                    strlen (object_hash)) < 0 ? -1 : 0;
+
+  free (output.data);
+  free (object.data);
+  free (directory);
+  free (input_path);
+  free (job_input);
+  free (object_path);
+  free (prefix_map);
+  free (argv);
+  return status;
+}
+
+/* Answer the client until it's done. */
+static void
+serve_connection (int fd)
+{
+  struct connection *connection = calloc (1, sizeof *connection);
+  struct frame frame;
+  char *client_directory = NULL;
+  int result = 0;
+
+  if (connection == NULL)
+    {
+      close (fd);
+      return;
+    }
+  connection->fd = fd;
+  memset (&frame, 0, sizeof frame);
+
+  while (result == 0 && read_frame (connection, &frame) == 0)
+    {
+      const char *error = NULL;
+      char *path = NULL;
+
+      if (strcmp (frame.verb, "DIR") == 0)
+        {
+          free (client_directory);
+          client_directory = strdup (frame.payload.data);
+          continue;
+        }
+      if (!is_hash (frame.argument))
+        error = "qake-worker: bad hash\n";
+      else if ((path = store_path (frame.argument)) == NULL)
+        error = "qake-worker: out of memory\n";
+      else if (strcmp (frame.verb, "HAVE") == 0)
+        result = write_frame (fd, store_use (path) == 0 ? "YES" : "NO",
+                              frame.argument, "", 0);
+      else if (strcmp (frame.verb, "PUT") == 0)
+        {
+          char hash[HASH_SIZE + 1];
+
+          hash_hex (frame.payload.data, frame.payload.length, hash);
+          if (strcmp (hash, frame.argument) != 0)
+            error = "qake-worker: contents don't match the hash\n";
+          else if (store_put (path, frame.payload.data,
+                              frame.payload.length) < 0)
+            error = "qake-worker: can't write to the store\n";
+          else
+            result = write_frame (fd, "YES", frame.argument, "", 0);
+        }
+      else if (strcmp (frame.verb, "COMPILE") == 0)
+        {
+          if (store_use (path) != 0)
+            error = "qake-worker: the input isn't in the store\n";
+          else if ((error = refusal (&frame.payload)) == NULL)
+            result = compile (connection, frame.argument, &frame.payload,
+                              client_directory);
+        }
+      else if (strcmp (frame.verb, "GET") == 0)
+        {
+          struct buffer contents = { NULL, 0, 0 };
+
+          if (read_file (path, &contents) == 0)
+            {
+              store_use (path);
+              result = write_frame (fd, "BLOB", frame.argument,
+                                    contents.data, contents.length);
+            }
+          else
+            result = write_frame (fd, "NO", frame.argument, "", 0);
+          free (contents.data);
+        }
+      else
+        error = "qake-worker: unknown request\n";
+      free (path);
+
+      if (error != NULL)
+        {
+          write_frame (fd, "ERROR", "-", error, strlen (error));
+          break;
+        }
+      *pool.last_used = time (NULL);
+    }
+
+  free (frame.payload.data);
+  free (client_directory);
+  free (connection);
+  close (fd);
+}
+
+/* A process of the pool: take clients one by one, and look around
+ *   every second while there are none. */
+static void
+serve_clients (int listener)
+{
+  for (;;)
+    {
+      struct pollfd fd = { listener, POLLIN, 0 };
+      int ready = poll (&fd, 1, 1000);
+
+      if (ready < 0 && errno != EINTR)
+        _exit (1);
+      if (ready > 0)
+        {
+          int client = accept4 (listener, NULL, NULL, SOCK_CLOEXEC);
+
+          if (client >= 0)
+            {
+              *pool.last_used = time (NULL);
+              serve_connection (client);
+              *pool.last_used = time (NULL);
+            }
+        }
+      else if (!socket_is_ours ()
+               || time (NULL) - *pool.last_used > (time_t) pool.idle)
+        _exit (0);
+    }
+}
+
+static pid_t
+start_process (int listener)
+{
+  pid_t pid = fork ();
+
+  if (pid == 0)
+    serve_clients (listener);
+  return pid;
+}
+
+/* Remove everything in the store of the pool: inputs, objects,
+ *   and whatever jobs left behind. */
+static void
+empty_store (void)
+{
+  DIR *directory = opendir (pool.store);
+  struct dirent *entry;
+
+  if (directory == NULL)
+    return;
+  while ((entry = readdir (directory)) != NULL)
+    {
+      char *path;
+
+      if (strcmp (entry->d_name, ".") == 0 || strcmp (entry->d_name, "..") == 0
+          || (path = store_path (entry->d_name)) == NULL)
+        continue;
+      if (unlink (path) < 0 && errno == EISDIR)
+        {
+          static const char *const files[] = { "input", "object.o", NULL };
+          const char *const *file;
+
+          for (file = files; *file; file++)
+            {
+              char *job_file;
+
+              if (asprintf (&job_file, "%s/%s", path, *file) >= 0)
+                {
+                  unlink (job_file);
+                  free (job_file);
+                }
+            }
+          rmdir (path);
+        }
+      free (path);
+    }
+  closedir (directory);
+}
+
+static int
+connect_to (const char *socket_path)
+{
+  struct sockaddr_un address;
+  int fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+  memset (&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  strncpy (address.sun_path, socket_path, sizeof address.sun_path - 1);
+  if (fd >= 0
+      && connect (fd, (struct sockaddr *) &address, sizeof address) < 0)
+    {
+      close (fd);
+      return -1;
+    }
+  return fd;
+}
+
+static int
+serve (const char *socket_path, const char *store, int jobs, unsigned idle,
+       uint64_t store_limit, char **compilers)
+{
+  struct sockaddr_un address;
+  struct stat st;
+  char *socket_dir = strdup (socket_path);
+  char *slash = strrchr (socket_dir, '/');
+  char *directory;
+  int running;
+  int listener;
+  int i;
+
+  /* The pool is up already. */
+  listener = connect_to (socket_path);
+  if (listener >= 0)
+    {
+      close (listener);
+      return 0;
+    }
+
+  memset (&address, 0, sizeof address);
+  address.sun_family = AF_UNIX;
+  if (strlen (socket_path) >= sizeof address.sun_path)
+    {
+      fprintf (stderr, "qake-worker: %s: path is too long\n", socket_path);
+      return 1;
+    }
+  strcpy (address.sun_path, socket_path);
+
+  if (slash != NULL)
+    {
+      *slash = '\0';
+      make_directories (socket_dir);
+    }
+  free (socket_dir);
+  /* A pool exiting mustn't empty the store of the one replacing it. */
+  make_directories (store);
+  directory = realpath (store, NULL);
+  if (directory == NULL
+      || asprintf (&pool.store, "%s/pool.XXXXXX", directory) < 0
+      || mkdtemp (pool.store) == NULL)
+    {
+      fprintf (stderr, "qake-worker: %s: %s\n", store, strerror (errno));
+      return 1;
+    }
+  free (directory);
+  pool.socket_path = socket_path;
+  pool.idle = idle;
+  pool.store_limit = store_limit;
+  pool.compilers = compilers;
+  pool.last_used = mmap (NULL, sizeof *pool.last_used,
+                         PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                         -1, 0);
+  if (pool.last_used == MAP_FAILED)
+    {
+      fprintf (stderr, "qake-worker: mmap: %s\n", strerror (errno));
+      return 1;
+    }
+  *pool.last_used = time (NULL);
+  pool.store_size = mmap (NULL, sizeof *pool.store_size,
+                          PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS,
+                          -1, 0);
+  if (pool.store_size == MAP_FAILED)
+    {
+      fprintf (stderr, "qake-worker: mmap: %s\n", strerror (errno));
+      return 1;
+    }
+  *pool.store_size = 0;
+
+  /* Nothing answers there: the socket, if any, is left by a pool
+   *   that's gone. */
+  unlink (socket_path);
+  listener = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listener < 0
+      || bind (listener, (struct sockaddr *) &address, sizeof address) < 0
+      || listen (listener, SOMAXCONN) < 0
+      || stat (socket_path, &st) < 0)
+    {
+      fprintf (stderr, "qake-worker: %s: %s\n", socket_path, strerror (errno));
+      return 1;
+    }
+  pool.socket_dev = st.st_dev;
+  pool.socket_ino = st.st_ino;
+
+  switch (fork ())
+    {
+    case -1:
+      fprintf (stderr, "qake-worker: fork: %s\n", strerror (errno));
+      return 1;
+    case 0:
+      break;
+    default:
+      return 0;
+    }
+  setsid ();
+  signal (SIGPIPE, SIG_IGN);
+  i = open ("/dev/null", O_RDWR);
+  dup2 (i, 0);
+  dup2 (i, 1);
+  dup2 (i, 2);
+  if (i > 2)
+    close (i);
+  /* Make passes its' jobserver to recipes: we don't need it, and Make
+   *   would wait for us to release it. */
+  for (i = 3; i < 1024; i++)
+    if (i != listener)
+      close (i);
+
+  for (running = 0; running < jobs; running++)
+    if (start_process (listener) < 0)
+      break;
+
+  /* A process killed by a crash of the compiler, or by mistake,
+   *   is replaced. Ones exiting by themselves aren't. */
+  while (running > 0)
+    {
+      int status;
+
+      if (wait (&status) < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          break;
+        }
+      if (WIFSIGNALED (status) && socket_is_ours ()
+          && start_process (listener) > 0)
+        continue;
+      running--;
+    }
+
+  if (socket_is_ours ())
+    unlink (socket_path);
+  empty_store ();
+  rmdir (pool.store);
+  return 0;
+}
+
+/* The client. */
+
+/* Options taking the next argument as their' value, as GCC has them. */
+static const char *const options_with_values[] = {
+  "-o", "-x", "-MF", "-MT", "-MQ", "-I", "-D", "-U", "-include", "-imacros",
+  "-isystem", "-iquote", "-idirafter", "-iprefix", "-iwithprefix",
+  "-iwithprefixbefore", "-isysroot", "-imultilib", "-Xpreprocessor",
+  "-Xassembler", "-Xlinker", "-aux-info", "--param", "-L", "-l", NULL
+};
+
+/* Options only the preprocessor needs. */
+static const char *const preprocessor_options[] = {
+  "-MF", "-MT", "-MQ", "-I", "-D", "-U", "-include", "-imacros", "-isystem",
+  "-iquote", "-idirafter", "-iprefix", "-iwithprefix", "-iwithprefixbefore",
+  "-isysroot", "-imultilib", "-Xpreprocessor", NULL
+};
+
+static const char *const preprocessor_flags[] = {
+  "-M", "-MM", "-MD", "-MMD", "-MP", "-MG", "-nostdinc", "-nostdinc++",
+  "-undef", "-H", NULL
+};
+
+static int
+is_one_of (const char *argument, const char *const *list)
+{
+  for (; *list; list++)
+    if (strcmp (argument, *list) == 0)
+      return 1;
+  return 0;
+}
+
+/* -I, -D and -U may be joined with their' values. */
+static int
+is_joined_preprocessor_option (const char *argument)
+{
+  return strncmp (argument, "-I", 2) == 0 || strncmp (argument, "-D", 2) == 0
+    || strncmp (argument, "-U", 2) == 0 || strncmp (argument, "-Wp,", 4) == 0;
+}
+
+/* Language of the preprocessed source, by the suffix of the source. */
+static const char *
+preprocessed_language (const char *source)
+{
+  static const char *const cxx[] = {
+    ".cc", ".cp", ".cxx", ".cpp", ".CPP", ".c++", ".C", NULL
+  };
+  const char *dot = strrchr (source, '.');
+
+  if (dot == NULL)
+    return NULL;
+  if (strcmp (dot, ".c") == 0)
+    return "cpp-output";
+  if (is_one_of (dot, cxx))
+    return "c++-cpp-output";
+  return NULL;
+}
+
+/* What the client needs to know about the compiler command. */
+struct command
+{
+  char **argv;
+  int argc;
+  int source;
+  int output;
+  int compile;
+  int dependencies;
+  int dependency_file;
+  int dependency_target;
+  const char *language;
+};
+
+/* Returns -1 if the pool can't run the command. */
+static int
+parse_command (char **argv, struct command *command)
+{
+  int i;
+  int sources = 0;
+
+  memset (command, 0, sizeof *command);
+  command->argv = argv;
+  for (i = 1; argv[i]; i++)
+    {
+      const char *argument = argv[i];
+
+      command->argc = i + 1;
+      if (strcmp (argument, "-c") == 0)
+        command->compile = i;
+      else if (strcmp (argument, "-o") == 0 && argv[i + 1])
+        command->output = i + 1;
+      else if (strcmp (argument, "-MD") == 0 || strcmp (argument, "-MMD") == 0)
+        command->dependencies = i;
+      else if (strcmp (argument, "-MF") == 0)
+        command->dependency_file = i;
+      else if (strcmp (argument, "-MT") == 0 || strcmp (argument, "-MQ") == 0)
+        command->dependency_target = i;
+      else if (strncmp (argument, "-x", 2) == 0 || strcmp (argument, "-") == 0
+               || strncmp (argument, "-save-temps", 11) == 0)
+        return -1;
+      else if (argument[0] != '-')
+        {
+          command->source = i;
+          sources++;
+        }
+
+      if (is_one_of (argument, options_with_values) && argv[i + 1])
+        {
+          i++;
+          command->argc = i + 1;
+        }
+    }
+  if (!command->compile || !command->output || sources != 1)
+    return -1;
+  command->language = preprocessed_language (argv[command->source]);
+  return command->language ? 0 : -1;
+}
+
+/* Run a process, collecting its' standard output. Errors go to ours. */
+static int
+run_collecting (char **argv, struct buffer *output)
+{
+  int pipe_fds[2];
+  int status;
+  pid_t pid;
+
+  if (pipe2 (pipe_fds, O_CLOEXEC) < 0)
+    return -1;
+  pid = fork ();
+  if (pid == 0)
+    {
+      dup2 (pipe_fds[1], 1);
+      execvp (argv[0], argv);
+      fprintf (stderr, "qake-worker: %s: %s\n", argv[0], strerror (errno));
+      _exit (127);
+    }
+  close (pipe_fds[1]);
+  if (pid < 0)
+    {
+      close (pipe_fds[0]);
+      return -1;
+    }
+  read_all (pipe_fds[0], output);
+  close (pipe_fds[0]);
+  while (waitpid (pid, &status, 0) < 0)
+    if (errno != EINTR)
+      return -1;
+  return WIFEXITED (status) ? WEXITSTATUS (status) : 128 + WTERMSIG (status);
+}
+
+/* The same command, only preprocessing to our standard output.
+ * The dependency file is named after the object, and so is its' target,
+ *   unless they're given: -o isn't passed here. */
+static int
+preprocess (const struct command *command, struct buffer *output)
+{
+  char **argv = calloc (command->argc + 6, sizeof *argv);
+  char *dependency_file = NULL;
+  int n = 0;
+  int i;
+  int status;
+
+  if (argv == NULL)
+    return -1;
+  for (i = 0; i < command->argc; i++)
+    if (i == command->compile)
+      argv[n++] = "-E";
+    else if (i == command->output - 1)
+      i++;
+    else
+      argv[n++] = command->argv[i];
+  if (command->dependencies && !command->dependency_file)
+    {
+      const char *object = command->argv[command->output];
+      const char *dot = strrchr (object, '.');
+      int length = dot && !strchr (dot, '/') ? dot - object
+        : (int) strlen (object);
+
+      if (asprintf (&dependency_file, "%.*s.d", length, object) < 0)
+        {
+          free (argv);
+          return -1;
+        }
+      argv[n++] = "-MF";
+      argv[n++] = dependency_file;
+    }
+  if (command->dependencies && !command->dependency_target)
+    {
+      argv[n++] = "-MQ";
+      argv[n++] = command->argv[command->output];
+    }
+  argv[n] = NULL;
+
+  status = run_collecting (argv, output);
+  free (dependency_file);
+  free (argv);
+  return status;
+}
+
+/* Arguments for the pool: the compiler and its' options, without the ones
+ *   of the preprocessor, the source and the output. */
+static void
+pool_arguments (const struct command *command, struct buffer *arguments)
+{
+  int i;
+
+  for (i = 0; i < command->argc; i++)
+    {
+      const char *argument = command->argv[i];
+
+      if (i == command->compile || i == command->source)
+        continue;
+      if (i == command->output - 1 || is_one_of (argument, preprocessor_options))
+        {
+          i++;
+          continue;
+        }
+      if (is_one_of (argument, preprocessor_flags)
+          || is_joined_preprocessor_option (argument))
+        continue;
+      buffer_append (arguments, argument, strlen (argument) + 1);
+      if (is_one_of (argument, options_with_values) && i + 1 < command->argc)
+        {
+          i++;
+          buffer_append (arguments, command->argv[i],
+                         strlen (command->argv[i]) + 1);
+        }
+    }
+  buffer_append (arguments, "-x", 3);
+  buffer_append (arguments, command->language,
+                 strlen (command->language) + 1);
+}
+
+/* Expect a frame with the given verb. */
+static int
+expect (struct connection *connection, struct frame *frame, const char *verb)
+{
+  if (read_frame (connection, frame) < 0)
+    return -1;
+  if (strcmp (frame->verb, "ERROR") == 0)
+    fprintf (stderr, "%s", frame->payload.data);
+  return strcmp (frame->verb, verb) == 0 ? 0 : -1;
+}
+
+/* Returns the status of the compiler, or -1 if the pool failed us:
+ *   then the command is run here. */
+static int
+compile_on_pool (int fd, const struct command *command,
+                 const struct buffer *source)
+{
+  struct connection *connection = calloc (1, sizeof *connection);
+  struct buffer arguments = { NULL, 0, 0 };
+  struct frame frame;
+  char source_hash[HASH_SIZE + 1];
+  char object_hash[HASH_SIZE + 1];
+  char *directory = getcwd (NULL, 0);
+  int status = -1;
+
+  memset (&frame, 0, sizeof frame);
+  if (connection == NULL || directory == NULL)
+    goto out;
+  connection->fd = fd;
+  hash_hex (source->data, source->length, source_hash);
+  pool_arguments (command, &arguments);
+
+  if (write_frame (fd, "DIR", "-", directory, strlen (directory)) < 0
+      || write_frame (fd, "HAVE", source_hash, "", 0) < 0
+      || read_frame (connection, &frame) < 0)
+    goto out;
+  if (strcmp (frame.verb, "YES") != 0
+      && (write_frame (fd, "PUT", source_hash, source->data,
+                       source->length) < 0
+          || expect (connection, &frame, "YES") < 0))
+    goto out;
+
+  if (write_frame (fd, "COMPILE", source_hash, arguments.data,
+                   arguments.length) < 0
+      || expect (connection, &frame, "STDERR") < 0)
+    goto out;
+  write_all (2, frame.payload.data, frame.payload.length);
+  if (expect (connection, &frame, "DONE") < 0)
+    goto out;
+  status = atoi (frame.argument);
+  if (status != 0)
+    goto out;
+
+  if (frame.payload.length != HASH_SIZE)
+    {
+      status = -1;
+      goto out;
+    }
+  memcpy (object_hash, frame.payload.data, HASH_SIZE);
+  object_hash[HASH_SIZE] = '\0';
+  if (write_frame (fd, "GET", object_hash, "", 0) < 0
+      || expect (connection, &frame, "BLOB") < 0
+      || write_file (command->argv[command->output], frame.payload.data,
+                     frame.payload.length) < 0)
+    status = -1;
+
+out:
+  free (frame.payload.data);
+  free (arguments.data);
+  free (directory);
+  free (connection);
+  close (fd);
+  return status;
+}
+
+static int
+compile_command (const char *socket_path, char **argv)
+{
+  struct command command;
+  struct buffer source = { NULL, 0, 0 };
+  int fd;
+  int status;
+
+  /* The pool isn't kept busy while we preprocess: we connect after. */
+  if (parse_command (argv, &command) < 0 || access (socket_path, F_OK) < 0)
+    {
+      execvp (argv[0], argv);
+      fprintf (stderr, "qake-worker: %s: %s\n", argv[0], strerror (errno));
+      return 127;
+    }
+  signal (SIGPIPE, SIG_IGN);
+
+  status = preprocess (&command, &source);
+  if (status != 0)
+    return status < 0 ? 1 : status;
+  fd = connect_to (socket_path);
+  status = fd < 0 ? -1 : compile_on_pool (fd, &command, &source);
+  free (source.data);
+  if (status < 0)
+    {
+      execvp (argv[0], argv);
+      fprintf (stderr, "qake-worker: %s: %s\n", argv[0], strerror (errno));
+      return 127;
+    }
+  return status;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (argc >= 4 && strcmp (argv[1], "--serve") == 0)
+    {
+      static char *default_compilers[] = { "gcc", "g++", NULL };
+      char **compilers = calloc (argc, sizeof *compilers);
+      long jobs = sysconf (_SC_NPROCESSORS_ONLN);
+      unsigned long idle = 600;
+      unsigned long long store_size = 1024;
+      int count = 0;
+      int i;
+
+      for (i = 4; compilers != NULL && i + 1 < argc; i += 2)
+        if (strcmp (argv[i], "--jobs") == 0)
+          jobs = strtol (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--idle") == 0)
+          idle = strtoul (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--store-size") == 0)
+          store_size = strtoull (argv[i + 1], NULL, 10);
+        else if (strcmp (argv[i], "--compiler") == 0)
+          compilers[count++] = argv[i + 1];
+        else
+          break;
+      if (compilers != NULL && i == argc)
+        return serve (argv[2], argv[3], jobs > 0 ? jobs : 1, idle,
+                      store_size << 20,
+                      count > 0 ? compilers : default_compilers);
+    }
+  if (argc >= 5 && strcmp (argv[1], "--compile") == 0
+      && strcmp (argv[3], "--") == 0)
+    return compile_command (argv[2], argv + 4);
+
+  fprintf (stderr, "Usage: qake-worker --serve SOCKET STORE"
+           " [--jobs N] [--idle SECONDS]\n"
+           "         [--store-size MEGABYTES] [--compiler NAME]...\n"
+           "       qake-worker --compile SOCKET -- COMMAND...\n");
+  return 2;
+}
@@ -0,0 +1,70 @@
+# Plan of the build for the progress counter (see PROGRESS in prologue.mk).
+#
+# Usage: make -pqk ... | awk -f progress.awk -v PLAN=... -v HISTORY=... -
+#
+# This is what qake runs before the build when given PROGRESS=y.
+# Standard input is Make's database after a question run: targets which
+#   would be updated are marked there as "Needs to be updated". Make marks
+#   all of them, not just the first out-of-date ones: that's what -k is for.
+# Of these, only the targets printing something count: ones under
+#   RES_DIR (objects, precompiled headers, programs and libraries) and
+#   directory markers. Markers and command files are updated silently.
+#
+# The plan is written to PLAN, sorted, one target per line with its'
+#   weight, as long as it took according to the history of durations
+#   (see durations.awk):
+#   build/res/circled/ircq.c.o 655000
+# Targets not built before weigh the average of the ones that were.
+# PLAN.state is the counter itself, which native/relay.c increments
+#   as targets are done: targets done, targets planned, total weight
+#   and weight done, in fixed-width fields so that it's rewritten in place.
+
+BEGIN {
+    if (RES_DIR == "")
+        RES_DIR = "build/res"
+}
+
+/^# Files/ { IN_FILES = 1; next }
+/^# (VPATH|files hash-table)/ { IN_FILES = 0; next }
+
+IN_FILES && /^[^#\t %][^=]*:( |$)/ && !/^[^ ]*:[:!?+]?=/ {
+    target = substr($0, 1, index($0, ":") - 1)
+    RECIPE = 0
+    next
+}
+
+# Needs to be updated (-q is set).
+IN_FILES && /^#  Needs to be updated/ &&
+(index(target, RES_DIR "/") == 1 || target ~ /\/\.directory\.marker$/) {
+    PLANNED[target] = 1
+    next
+}
+
+# Files written with $(file), like the stub of a precompiled header,
+#   are updated by Make itself.
+IN_FILES && /^>/ && !RECIPE++ && /^> *\$\$?\(file / {
+    delete PLANNED[target]
+}
+
+END {
+    if (HISTORY != "")
+        while ((getline line < HISTORY) > 0)
+            if (split(line, fields, " ") == 2 && fields[1] ~ /^us:[0-9]+$/) {
+                DURATION[fields[2]] = substr(fields[1], 4) + 0
+                KNOWN_US += DURATION[fields[2]]
+                KNOWN++
+            }
+    AVERAGE = KNOWN ? int(KNOWN_US / KNOWN) : 0
+
+    printf "" > PLAN
+    close(PLAN)
+    sort = "LC_ALL=C sort > " PLAN
+    for (target in PLANNED) {
+        weight = target in DURATION ? DURATION[target] : AVERAGE
+        print target, weight | sort
+        COUNT++
+        TOTAL += weight
+    }
+    close(sort)
+    printf "%10d %10d %15.0f %15.0f\n", 0, COUNT, TOTAL, 0 > (PLAN ".state")
+}
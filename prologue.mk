@@ -5,12 +5,47 @@ ifeq (, $(shell which md5sum))
 else
   HASH := md5sum
 endif
-  
+
+# Stat tuple used to detect metadata changes without reading the file:
+#   inode, size, mtime and ctime (both with nanoseconds).
+# GNU stat uses -c with its' own format letters, BSD one uses -f.
+ifeq (, $(shell stat --version 2>/dev/null))
+  STAT := stat -f '%i %z %Fm %Fc'
+else
+  STAT := stat -c '%i %s %.9Y %.9Z'
+endif
+
+# Native helpers (see native/ directory) are loaded if they're built.
+# Loadable module adds functions to Make, which do hashing and similar stuff
+#   right inside Make process, without spawning anything.
+# If the object isn't there, we just fall back to the shell implementation.
+# We have to check it with $(wildcard): otherwise Make would look for
+#   a rule to build the missing object and fail, even with '-load'.
+# To force the fallback, do:
+# make QAKE_NATIVE=n
+# More on loading of objects:
+# https://www.gnu.org/software/make/manual/html_node/load-Directive.html
+QAKE_NATIVE := y
+ifeq ($(QAKE_NATIVE),y)
+ifneq (,$(wildcard $(QAKE_INCLUDE_DIR)/native/qake.so))
+-load $(QAKE_INCLUDE_DIR)/native/qake.so
+endif
+endif
+QAKE_MODULE := $(filter %/native/qake.so,$(.LOADED))
+
 # This is to precisely track what's going on.
 # It's used by Make as command interpreter.
 # By default, Make uses /bin/sh as interpreter for recipes.
 # We overload that to pass everything through our script.
+# Native version of the script is used when it's built: it saves
+#   a shell startup and several processes per recipe.
+# The script is the fallback.
+ifneq (,$(and $(filter y,$(QAKE_NATIVE)),\
+              $(wildcard $(QAKE_INCLUDE_DIR)/native/qake-relay)))
+SHELL := $(QAKE_INCLUDE_DIR)/native/qake-relay
+else
 SHELL := $(QAKE_INCLUDE_DIR)/relay.sh
+endif
 
 # This was to inhibit hash checking for phony targets.
 # TODO: Remove this setting.
@@ -64,8 +99,16 @@ $(if $(shell if ! $(MAKE) --version | grep 'GNU Make 4.' > /dev/null; \
 # -R removes built-in variables (like CC).
 # Just to get rid of another source of confusion and make everything explicit.
 #
-# -j makes build parallel by default.
+# -j makes build parallel by default, one job per core.
 # Helps to discover underspecified dependencies and speeds up things.
+# Bare -j would start everything it can at once, which on a large tree
+#   means hundreds of compilers, and swapping or OOM killer.
+# Number of jobs is also what makes Make start its' jobserver,
+#   which the relay uses to give heavy targets several job slots
+#   and to hold jobs back while the machine is short of memory
+#   (see JOB_WEIGHT below).
+# To change the number of jobs, do:
+# make JOBS=16
 #
 # -O enables synchronization of output during parallel build.
 # It is done on per-target basis: all commands of one target
@@ -76,7 +119,8 @@ $(if $(shell if ! $(MAKE) --version | grep 'GNU Make 4.' > /dev/null; \
 # will specify only '-j'. You can also pass empty string.
 # More about overriding any Make variable on the command line:
 # https://www.gnu.org/software/make/manual/html_node/Overriding.html#Overriding
-MAKEFLAGS := -r -R -j -O -s
+JOBS := $(shell getconf _NPROCESSORS_ONLN)
+MAKEFLAGS := -r -R -j$(JOBS) -O -s
 
 # Second expansion is used in this solution to seamlessly create
 #   directories for target files.
@@ -226,6 +270,37 @@ $(call PRINT1,$1)
 $(eval $1)
 endef
 
+# Function: Evaluate an assignment right away, and also leave it
+#   in the expanded text.
+# It's for the variables which the rest of the text refers to:
+#   when the text is cached (see CACHED_RULES), it's all that's left.
+define EMIT1
+$(call TRACE1,$1)
+$1
+endef
+
+# Single space character. Make strips leading and trailing whitespace of
+#   variable values, so we have to put it between two empty references.
+EMPTY :=
+SPACE := $(EMPTY) $(EMPTY)
+
+# Comma can't be written as is in arguments of functions:
+#   it would separate them.
+COMMA := ,
+
+# Newline: for text which is $(eval)'ed or written with $(file).
+define NEWLINE
+
+
+endef
+
+# Function: Expand to non-empty string if both parameters are the same.
+# Each one must be found in another one, so they're equal.
+# Both are wrapped in 'x': empty strings are equal too.
+define EQUAL
+$(and $(findstring x$1x,x$2x),$(findstring x$2x,x$1x))
+endef
+
 # Directory creation:
 # Use secondary expansion to get name of directory of target.
 # We insert additional dollar sign to prevent expansion of $(@D) automatic variable.
@@ -239,6 +314,13 @@ define DIRECTORY
 $$(@D)/.directory.marker
 endef
 
+# Function: Directory marker of the given file, when it's known in advance.
+# It's the same as $(DIRECTORY) expands to in the recipe of the file:
+#   $(@D) drops just one trailing slash, and so does this.
+define DIRECTORY_OF
+$(patsubst %/,%,$(dir $1))/.directory.marker
+endef
+
 # Implicit rule for all marker files.
 # % is called a stem of pattern rule.
 # It matches the part of file path of target.
@@ -280,6 +362,78 @@ AUX_DIR := $(BUILD_DIR)/aux
 DU_DIR :=  $(AUX_DIR)/
 RES_DIR := $(BUILD_DIR)/res
 
+# Timeline of the build: every recipe appends an event with its' duration,
+#   CPU time and memory to this file (see native/relay.c for details).
+# Open it in chrome://tracing or https://ui.perfetto.dev.
+# Only the native relay does that: relay.sh would have to spawn 'date'
+#   twice per recipe, which isn't cheap.
+# The file is started anew by each build, if the directory is there already.
+# $(file) doesn't spawn anything.
+# To disable, do:
+# make TRACE=n
+TRACE := y
+
+# 'qake --critical-path' reads the timeline of the last build, so it has
+#   to stay in place. The script says so in the environment: TRACE=n on
+#   the command line would change the key of the rules cache (see
+#   RULES_KEY), and the rules would be expanded again, twice.
+ifdef QAKE_KEEP_TRACE
+TRACE := n
+endif
+
+# History of durations of targets, slowest first (see durations.awk).
+# Before the timeline is started anew, durations from it are merged
+#   into the history. That's only done when the last build ran something:
+#   timeline of a null build is just the opening '['.
+# Make starts prerequisites in the order they're listed,
+#   so lists of objects are ordered by the history (see SLOWEST_FIRST).
+# Otherwise the slowest object may happen to be the last in the list,
+#   and start when all the rest is done.
+DURATIONS := $(AUX_DIR)/durations
+
+ifeq ($(TRACE),y)
+export QAKE_TRACE := $(AUX_DIR)/trace.json
+ifneq (,$(word 2,$(file <$(QAKE_TRACE))))
+$(shell awk -f $(QAKE_INCLUDE_DIR)/durations.awk \
+          $(wildcard $(DURATIONS)) $(QAKE_TRACE) > $(DURATIONS).new \
+        && mv $(DURATIONS).new $(DURATIONS))
+endif
+ifneq (,$(wildcard $(AUX_DIR)))
+$(file >$(QAKE_TRACE),[)
+endif
+endif
+
+QAKE_SLOWEST_FIRST := $(filter-out us:%,$(file <$(DURATIONS)))
+
+# Progress of the build, with an estimate of the time left,
+#   in front of what targets print:
+# [12/40 ETA 1:05] GCC ircq.c.o
+# Before the build, qake asks Make what it would update (-q), without
+#   updating it, and progress.awk plans the build out of that and
+#   the history of durations (see DURATIONS).
+# That's another reading of Makefiles per build, so it's off by default.
+# It's qake that plans, and passes the plan to the relay in QAKE_PROGRESS:
+#   Make alone, and qake with the build daemon, build without the counter.
+# Only the native relay counts targets (see native/relay.c).
+# Enable it like this:
+# qake PROGRESS=y
+PROGRESS := n
+
+# Job slots taken by a recipe. Heavy targets (links of large programs,
+#   huge translation units) should take more: see HEAVY below.
+# The relay also doesn't start a job while there's less than JOB_MEMORY
+#   megabytes of available memory per its' slot, or while load average
+#   is above MAX_LOAD (twice the number of cores, if empty).
+# It waits instead, unless no other job is running.
+# See native/relay.c for details; relay.sh doesn't do any of that.
+JOB_WEIGHT := 1
+JOB_MEMORY := 512
+MAX_LOAD :=
+export QAKE_JOB_WEIGHT = $(JOB_WEIGHT)
+export QAKE_JOB_MEMORY = $(JOB_MEMORY)
+export QAKE_MAX_LOAD = $(MAX_LOAD)
+export QAKE_JOBS_LOCK := $(AUX_DIR)/jobs.lock
+
 # This directory will hold sources.
 # Good build system mirrors sources structure in build directory --
 #   it allows to manage pattern rules easier.
@@ -304,6 +458,29 @@ echo $(call &,$0,DESCRIPTION); if ! $(call &,$0,COMMAND);\
 endef
 
 
+# Function: Order the targets so that the slowest ones start first,
+#   according to the history of durations (see DURATIONS).
+# Targets never built before go first: they may well be the slowest.
+define SLOWEST_FIRST
+$(filter-out $(QAKE_SLOWEST_FIRST),$1) $(filter $1,$(QAKE_SLOWEST_FIRST))
+endef
+
+# Function: Make targets take several job slots.
+# Targets are paths under the build directory, as they're named there:
+#   $(eval $(call HEAVY,circled/circled circled/irc.c.o,4))
+# The timeline (see TRACE) shows which targets need that:
+#   look at max_rss_kb of events.
+# The weight is private: prerequisites of a heavy link, its' objects,
+#   would inherit it otherwise.
+define HEAVY
+$(strip \
+$(call FUNCTION_DEBUG_HEADER,$0)
+$(call let,$0,TARGETS,$1)
+$(call let,$0,WEIGHT,$2)
+)
+$(addprefix $(RES_DIR)/,$(call &,$0,TARGETS)): private JOB_WEIGHT := $(strip $(call &,$0,WEIGHT))
+endef
+
 define GET_TARGET_PATH
 $(patsubst build/aux/%.cmd,%,$1)
 endef
@@ -317,53 +494,419 @@ $(patsubst %,build/aux/%.cmd.did_update,$1)
 endef
 
 
-# Function: Define build of a program.
-#
-# TODO: Update this documentation.
-#   It currently doesn't describe command tracking and dependencies hashing.
-#
-# Suppose we're calling this function as follows:
-# $(call PROGRAM,a,b,c.c,d,e,f)
-# (such flags make no sense, but we don't care, it's an example)
-#
-# We first define variable OBJ_b := build/c.c.o
-#
-# Then we define static pattern rule for objects:
-# $(OBJ_b): build/%.o: \
-#   src/% \
-# | $(DIRECTORY)
-# > $(COMPILE_OBJECT)
+# Rules of hashed chains: turn a tracked file into %.did_update marker,
+#   which is touched only when contents of the file actually change.
+# Everything which should be rebuilt on such change depends on the marker,
+#   not the file itself.
+# These are expanded inside PROGRAM, hence the doubled dollars.
 #
-# Details:
-# https://www.gnu.org/software/make/manual/html_node/Static-Pattern.html
-#
-# Then we specify CFLAGS for these objects via target-specific variable assignment:
-# https://www.gnu.org/software/make/manual/html_node/Target_002dspecific.html
-#
-# After that, we define DEP_b := $(OBJ_b:=.d).
-# This is called a substitution reference.
-# We substitute empty suffix of each list element with suffix '.d'.
-# This way, we get 'build/c.c.o.d' in DEP_b.
-# These are the dependency files as generated by GCC.
-# They contain all headers on which given object file depends on.
-#
-# Next, we define $(PROGRAM_b): $(OBJ_b) to specify prerequisites of program
-#   and its' recipe on next line.
-# LDFLAGS and LDLIBS are also specified in target-specific manner.
+# With the native module, digests are kept in a single store
+#   per build directory (see native/hashdb.c), and the marker is the only
+#   auxiliary file left for the tracked file.
+# The recipe expands to nothing, so no process is spawned.
+ifneq (,$(QAKE_MODULE))
+HASH_STORE := $(AUX_DIR)/hashes.db
+
+define UPDATE_MARKER
+$(qake-update $(HASH_STORE),$<,$@)
+endef
+
+# Markers of shared libraries' ABI: see SHARED_LIBRARY.
+define UPDATE_ABI_MARKER
+$(qake-update-abi $(HASH_STORE),$<,$@)
+endef
+
+define HASHED_CHAIN_RULES
+.PRECIOUS: $(AUX_DIR)/%.did_update
+
+$(AUX_DIR)/%.did_update: \
+  $(RES_DIR)/% \
+| $$(DIRECTORY)
+> $$(RECORD_DEPS)$$(UPDATE_MARKER)
+
+$(AUX_DIR)/%.did_update: \
+  $(SRC_DIR)/% \
+| $$(DIRECTORY)
+> $$(UPDATE_MARKER)
+
+$(AUX_DIR)/%.did_update: \
+  $(AUX_DIR)/% \
+| $$(DIRECTORY)
+> $$(UPDATE_MARKER)
+
+$(AUX_DIR)/%.abi.did_update: \
+  $(RES_DIR)/% \
+| $$(DIRECTORY)
+> $$(UPDATE_ABI_MARKER)
+endef
+
+# Function: Explicit rule of a marker (see EXPLICIT_RULES).
+# $1 is the marker, $2 is the tracked file.
+define EXPLICIT_MARKER
+$1: $2 | $(call DIRECTORY_OF,$1)
+> $$(RECORD_DEPS)$$(UPDATE_MARKER)
+
+endef
+else
+# Without the module, the digest is put into %.hash.new,
+#   and compared with %.hash.old which was saved last time.
+define HASHED_CHAIN_RULES
+.PRECIOUS: build/aux/%.did_update
+
+$(AUX_DIR)/%.did_update: \
+$(AUX_DIR)/%.hash.new
+>  $$(RECORD_DEPS)if [ -f $$(patsubst %.hash.new,\
+                       %.hash.old,\
+                       $$<) ];\
+   then \
+     if ! diff -q $$< $$(patsubst %.hash.new,\
+                                  %.hash.old,\
+                                  $$<) > /dev/null; \
+     then \
+         touch $$@; \
+     fi; \
+   else \
+     touch $$@; \
+   fi; \
+   cp $$< $$(patsubst %.hash.new,\
+                      %.hash.old,\
+                      $$<)
+
+.PRECIOUS: build/aux/%.hash.new
+
+$(AUX_DIR)/%.hash.new: \
+  $(RES_DIR)/% \
+| $$(DIRECTORY)
+> $$(HASH_FILE)
+
+$(AUX_DIR)/%.hash.new: \
+  $(SRC_DIR)/% \
+| $$(DIRECTORY)
+> $$(HASH_FILE)
+
+$(AUX_DIR)/%.hash.new: \
+  $(AUX_DIR)/% \
+| $$(DIRECTORY)
+> $$(HASH_FILE)
+
+$(AUX_DIR)/%.abi.hash.new: \
+  $(RES_DIR)/% \
+| $$(DIRECTORY)
+> $$(HASH_FILE)
+endef
+
+# Without the module, the ABI is listed by binutils and the listing is hashed.
+# Symbols are listed without addresses, and sizes are listed only for
+#   data, as in native/object.c.
+$(AUX_DIR)/%.abi.hash.new: private HASH_CONTENTS = \
+  { objdump -p $< | grep SONAME; \
+    nm -D --defined-only -P $< \
+    | awk '{ print $$1, $$2, ($$2 ~ /[BbDdGgRrSsVv]/ ? $$4 : "") }' \
+    | sort; } | $(HASH)
+
+# Markers are built through %.hash.new here, and explicit rules
+#   are left out for them: the pattern rules above do that.
+EXPLICIT_MARKER :=
+endif
+
+# Debug builds and pruning.
+# With -g, positions of code are recorded in the object: adding a comment
+#   moves the code below it, and the object changes, even though the code
+#   is the same. So the program is relinked.
+# With this, only code, data and symbols of objects are hashed,
+#   and debugging info (.debug_* sections) doesn't count.
+# The price is that the program keeps debugging info of the previous object
+#   when linking is pruned, and the debugger may show wrong lines until
+#   the next meaningful change. Enable it like this:
+# make IGNORE_DEBUG_INFO=y
 #
-# Finally, we do ALL += $(PROGRAM_b) to make 'all' target build this program.
+# Hashing is done by the native module (see native/object.c).
+# Without it, debugging info is stripped from a copy of the object with
+#   'objcopy', and the copy is hashed. If there's no 'objcopy',
+#   the object is hashed as is.
+# Variables are private: otherwise they would be inherited by prerequisites,
+#   and sources would be hashed the same way.
+IGNORE_DEBUG_INFO := n
+
+ifeq ($(IGNORE_DEBUG_INFO),y)
+ifneq (,$(QAKE_MODULE))
+$(AUX_DIR)/%.o.did_update: private UPDATE_MARKER = \
+  $(qake-update-object $(HASH_STORE),$<,$@)
+else
+$(AUX_DIR)/%.o.hash.new: private HASH_CONTENTS = \
+  { objcopy --strip-debug $< $@.o 2>/dev/null && $(HASH) < $@.o \
+    || $(HASH) $<; rm -f $@.o; }
+endif
+endif
+
+# Dependencies of objects on headers.
+# GCC lists them while compiling (-MD), in a .d file per object.
+# These aren't included one by one: that's a lot of small files to read
+#   on each run. Instead, when marker of the object is updated, Make
+#   appends the list to a single store, which is included here.
+#   That's done with $(file), so no process is spawned.
+# GCC is told to name the list as a variable (-MT), so that the latest
+#   list of an object wins over the ones appended before:
+#   QAKE_DEPS_build/res/circled/main.c.o:=: src/main.c src/circle.h ...
+# The value starts with ':' and the source itself: the object depends
+#   on the source through its' marker, so both are skipped. Headers are
+#   tracked through markers too, see HEADER_MARKERS below.
+# Headers are also listed as targets without prerequisites (-MP):
+#   this way, a removed header doesn't break the build.
+# Once the store holds twice as many lists as there are objects,
+#   it's written anew with just the latest ones.
+# Precompiled headers (see PRECOMPILED_HEADER) are recorded the same way.
+DEPS_STORE := $(AUX_DIR)/deps.mk
+
+$(AUX_DIR)/%.o.did_update $(AUX_DIR)/%.gch.did_update: private RECORD_DEPS = \
+  $(call RECORD_DEPS_OF,$(@:$(AUX_DIR)/%.did_update=$(RES_DIR)/%),$(file <$(@:.did_update=.d)))\
+  $(call MAKE_HEADER_MARKERS,$(UNITY_SOURCES),refresh)
+
+# Function: Append dependencies of the object $1, as GCC listed them ($2),
+#   to the store, unless they're the same as recorded.
+# The marker of the object isn't touched when the object didn't change
+#   meaningfully, so its' recipe runs again on the next build:
+#   without the check, the same list would be appended each time.
+# Markers of the headers listed are made right away, see MAKE_HEADER_MARKERS.
+define RECORD_DEPS_OF
+$(if $(call EQUAL,$(filter-out \ %:,$2),$(wordlist 2,$(words $(QAKE_DEPS_$1)),$(QAKE_DEPS_$1))),,\
+  $(file >>$(DEPS_STORE),$2$(NEWLINE)DEPS_RECORDS += $1)\
+  $(call MAKE_HEADER_MARKERS,$(wordlist 2,$(words $(filter-out \ %:,$2)),$(filter-out \ %:,$2))))
+endef
+
+# Headers go through the same content-hash gate as sources: objects
+#   depend on markers of headers, not on headers themselves. So touching
+#   a header, or checking out a branch where it's the same, doesn't
+#   recompile anything.
+# Markers of headers of the project are kept under $(HEADERS_DIR) by
+#   their' path relative to the project, and markers of the others (system
+#   ones, mostly) under $(SYSTEM_HEADERS_DIR) by absolute path. Either way,
+#   the path is normalized: GCC may name a header as src/d/../h.h.
+# A marker made for the first time is as old as the header: objects
+#   listing the header were compiled after it changed, if they were
+#   compiled at all (see qake-update-header in native/qake.c).
+#   Otherwise, the build after a full one would compile everything again.
+# A missing header (say, it was removed) makes the marker depend
+#   on MISSING_HEADER, which is always remade: the marker is touched,
+#   and objects including the header are compiled, and fail if they
+#   still include it.
 #
-# You can see all the generated goodness by replacing
-#   $(eval $(call PROGRAM, ...)) with
-#   $(info $(call PROGRAM, ...))
-define PROGRAM
+# With this, comments and layout of headers don't count either:
+#   such edits don't recompile anything. Enable it like this:
+# make IGNORE_HEADER_COMMENTS=y
+# The price: if only lines of a header moved, __LINE__ and debugging info
+#   of the code using it stay as they were. Without the native module,
+#   comments are stripped by the preprocessor, and the rest is reduced
+#   to tokens by tokens.awk.
+HEADERS_DIR := $(AUX_DIR)/.headers
+SYSTEM_HEADERS_DIR := $(AUX_DIR)/.system-headers
+IGNORE_HEADER_COMMENTS := n
+
+# Function: Markers of the given headers.
+define HEADER_MARKERS
+$(patsubst /%,$(SYSTEM_HEADERS_DIR)/%.did_update,\
+  $(patsubst $(CURDIR)/%,$(HEADERS_DIR)/%.did_update,$(abspath $1)))
+endef
+
+.PHONY: MISSING_HEADER
+MISSING_HEADER:
+
+ifneq (,$(QAKE_MODULE))
+ifeq ($(IGNORE_HEADER_COMMENTS),y)
+UPDATE_HEADER_OF = $(qake-update-header-code $(HASH_STORE),$1,$2,$3)
+else
+UPDATE_HEADER_OF = $(qake-update-header $(HASH_STORE),$1,$2,$3)
+endif
+
+UPDATE_HEADER = $(call UPDATE_HEADER_OF,$<,$@)
+UPDATE_HEADER_MARKER = $(if $(wildcard $<),$(UPDATE_HEADER),$(file >$@))
+
+# Function: Make missing markers of the given headers, with directories.
+# This is done by the build recording the headers (see RECORD_DEPS_OF),
+#   with no process spawned. Otherwise, the markers and a directory
+#   marker per directory of headers, each one a 'mkdir' and a 'touch',
+#   would be left for the build after, which is likely a null one.
+# The marker is made just like its' rule would: by then, the header
+#   is as it was compiled. Missing headers are left to the rule.
+# With $2 being 'refresh', digests of the headers are recorded in existing
+#   markers too, which aren't touched: see UNITY_SOURCES.
+define MAKE_HEADER_MARKERS
+$(foreach HEADER,$(wildcard $1),\
+  $(call MAKE_HEADER_MARKER,$(HEADER),$(call HEADER_MARKERS,$(HEADER)),$2))
+endef
+
+define MAKE_HEADER_MARKER
+$(if $(wildcard $2),\
+  $(if $3,$(call UPDATE_HEADER_OF,$1,$2,$3)),\
+  $(if $(wildcard $(call DIRECTORY_OF,$2)),,\
+    $(qake-mkdir $(dir $2))$(file >$(call DIRECTORY_OF,$2)))\
+  $(call UPDATE_HEADER_OF,$1,$2))
+endef
+
+$(HEADERS_DIR)/%.did_update: % | $(DIRECTORY)
+> $(UPDATE_HEADER_MARKER)
+
+$(SYSTEM_HEADERS_DIR)/%.did_update: /% | $(DIRECTORY)
+> $(UPDATE_HEADER_MARKER)
+
+$(HEADERS_DIR)/%.did_update: MISSING_HEADER | $(DIRECTORY)
+> $(file >$@)
+
+$(SYSTEM_HEADERS_DIR)/%.did_update: MISSING_HEADER | $(DIRECTORY)
+> $(file >$@)
+else
+# Here, %.hash.new gets modification time of the header,
+#   and a new marker gets it from %.hash.new.
+define HASH_HEADER
+$(if $(wildcard $<),$(HASH_FILE); touch -r $< $@,: > $@)
+endef
+
+define UPDATE_HEADER_MARKER
+if [ ! -f $@ ]; \
+then \
+  touch -r $< $@; \
+elif ! diff -q $< $(<:.new=.old) > /dev/null 2>&1; \
+then \
+  touch $@; \
+fi; \
+cp $< $(<:.new=.old)
+endef
+
+$(HEADERS_DIR)/%.did_update: $(HEADERS_DIR)/%.hash.new
+> $(UPDATE_HEADER_MARKER)
+
+$(SYSTEM_HEADERS_DIR)/%.did_update: $(SYSTEM_HEADERS_DIR)/%.hash.new
+> $(UPDATE_HEADER_MARKER)
+
+$(HEADERS_DIR)/%.hash.new: % | $(DIRECTORY)
+> $(HASH_HEADER)
+
+$(SYSTEM_HEADERS_DIR)/%.hash.new: /% | $(DIRECTORY)
+> $(HASH_HEADER)
+
+$(HEADERS_DIR)/%.hash.new: MISSING_HEADER | $(DIRECTORY)
+> : > $@
+
+$(SYSTEM_HEADERS_DIR)/%.hash.new: MISSING_HEADER | $(DIRECTORY)
+> : > $@
+
+.PRECIOUS: $(HEADERS_DIR)/%.hash.new $(SYSTEM_HEADERS_DIR)/%.hash.new
+
+ifeq ($(IGNORE_HEADER_COMMENTS),y)
+$(HEADERS_DIR)/%.hash.new $(SYSTEM_HEADERS_DIR)/%.hash.new: \
+  private HASH_CONTENTS = \
+    gcc -fpreprocessed -dD -E -P -x c++ $< \
+    | awk -f $(QAKE_INCLUDE_DIR)/tokens.awk | $(HASH)
+endif
+endif
+
+# Build directories of older versions have .d files to be included
+#   instead, with the source already removed by 'sed'. They're converted
+#   to the store once: a '-' takes place of the source.
+ifeq (,$(wildcard $(DEPS_STORE)))
+ifneq (,$(wildcard $(AUX_DIR)))
+$(shell find $(AUX_DIR) -name '*.o.d' -exec cat {} + \
+        | awk '{ line = line $$0 } \
+               /\\$$/ { sub(/\\$$/, "", line); next } \
+               line !~ /^QAKE_DEPS_/ && match(line, /^[^ :]+\.o:/) { \
+                 line = "QAKE_DEPS_" substr(line, 1, RLENGTH - 1) \
+                        ":=: -" substr(line, RLENGTH + 1) } \
+               { print line; line = "" }' > $(DEPS_STORE))
+endif
+endif
+
+-include $(DEPS_STORE)
+
+DEPS_OBJECTS := $(patsubst QAKE_DEPS_%,%,$(filter QAKE_DEPS_%,$(.VARIABLES)))
+
+$(eval $(foreach OBJECT,$(DEPS_OBJECTS),\
+  $(OBJECT): $(call HEADER_MARKERS,$(wordlist 3,$(words $(QAKE_DEPS_$(OBJECT))),$(QAKE_DEPS_$(OBJECT))))$(NEWLINE)))
+
+ifneq (,$(word $(words $(DEPS_OBJECTS) $(DEPS_OBJECTS) x),$(DEPS_RECORDS)))
+DEPS_HEADERS := $(sort $(foreach OBJECT,$(DEPS_OBJECTS),\
+  $(wordlist 3,$(words $(QAKE_DEPS_$(OBJECT))),$(QAKE_DEPS_$(OBJECT)))))
+$(file >$(DEPS_STORE),$(foreach OBJECT,$(DEPS_OBJECTS),\
+  QAKE_DEPS_$(OBJECT):=$(QAKE_DEPS_$(OBJECT))$(NEWLINE))$(if $(DEPS_HEADERS),$(DEPS_HEADERS):))
+endif
+
+# Function: Recipe writing the build command into the cmd file.
+# $1 is the name of canned command, like COMPILE_OBJECT.
+# The file is written by Make itself: no process is spawned for it,
+#   and the command may be of any length. Passed to the shell,
+#   a single argument can't exceed 128K, and a link command of
+#   a few thousand objects does.
+define WRITE_COMMAND
+$$(file >$$@,$$($1))
+endef
+
+# Explicit rules.
+# Rules of objects are pattern rules, and their' prerequisites are found
+#   by secondary expansion. So for each object, cmd file and marker,
+#   Make goes through the pattern rules, matching and checking them,
+#   and expands $(DIRECTORY) once again. That's per file and per run.
+# With this, PROGRAM and libraries write an explicit rule for each
+#   of these files instead, with all the names spelled out:
+# make EXPLICIT_RULES=y
+# Makefiles get larger (a few rules per source), but with RULES_CACHE
+#   they're written once. Markers get explicit rules only with
+#   the native module. Directory markers are shared by many targets,
+#   so they're still matched by the pattern rule, once per directory.
+# See tests/bench/explicit_rules.sh for the comparison.
+EXPLICIT_RULES := n
+
+# Function: Explicit rules of objects (see EXPLICIT_RULES).
+# $1 is the list of stems: paths of sources relative to source directory,
+#   as the pattern rules of OBJECTS would match them.
+# $2, $3 and $4 are what goes before the stem in the names of object,
+#   source marker and source.
+# The rules are the same as pattern rules of OBJECTS make up for these names.
+define EXPLICIT_OBJECTS
+$(foreach STEM,$1,$(call EXPLICIT_OBJECT,$2$(STEM).o,$3$(STEM).did_update,$4$(STEM)))
+endef
+
+# Function: Explicit rules of one object.
+# $1 is the object, $2 is the source marker, $3 is the source.
+define EXPLICIT_OBJECT
+$1: \
+  $(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd.did_update \
+  $2 \
+| $(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd \
+  $3 \
+  $(call DIRECTORY_OF,$1)
+> eval $$$$(cat $(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd)
+
+$(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd: \
+  $2 \
+  $(THIS_MAKEFILE) \
+| $3 \
+  $(call DIRECTORY_OF,$(1:$(RES_DIR)/%=$(AUX_DIR)/%))
+> $(call WRITE_COMMAND,COMPILE_OBJECT)
+
+$(call EXPLICIT_MARKER,$(1:$(RES_DIR)/%=$(AUX_DIR)/%).did_update,$1)
+$(call EXPLICIT_MARKER,$(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd.did_update,$(1:$(RES_DIR)/%=$(AUX_DIR)/%).cmd)
+$(call EXPLICIT_MARKER,$2,$3)
+endef
+
+# Function: Define build of objects out of sources.
+# This is the part shared by PROGRAM and SHARED_LIBRARY.
+# Parameters are the same as first four parameters of PROGRAM.
+# Objects go to build/res/<name of built thing>/, and their' list is put
+#   into OBJ_<name of built thing>.
+# Sources are looked for under $(SRC_DIR), and their' markers under
+#   $(DU_DIR), unless other directories are given as 5th and 6th
+#   parameters: sources made by qake itself are kept in the build directory
+#   (see UNITY_OBJECTS).
+# The 7th parameter is what every object depends on besides its' source
+#   and headers: marker of the precompiled header (see PRECOMPILED_HEADER).
+define OBJECTS
 $(call FUNCTION_DEBUG_HEADER,$0)
 $(call let,$0,SOURCE_NAME,$1)
 $(call let,$0,BUILT_NAME,$2)
 $(call let,$0,SRC,$3)
 $(call let,$0,CFLAGS,$4)
-$(call let,$0,LDFLAGS,$5)
-$(call let,$0,LDLIBS,$6)
+$(call let,$0,SOURCE_DIR,$(or $(strip $5),$(SRC_DIR)))
+$(call let,$0,MARKER_DIR,$(or $(strip $6),$(DU_DIR)))
+$(call let,$0,PREREQUISITES,$7)
 
 .SHELLFLAGS = --target $$@
 
@@ -373,115 +916,429 @@ $(RES_DIR)/%: \
   $$(DIRECTORY)
 > eval $$$$(cat $$(firstword $$|))
 
-$(call TRACE1,OBJ_$(call &,$0,BUILT_NAME)_CMD := $(strip \
-  $(patsubst $(SRC_DIR)/$(call &,$0,SOURCE_NAME)%,\
+$(call EMIT1,OBJ_$(call &,$0,BUILT_NAME)_CMD := $(strip \
+  $(patsubst $(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME)%,\
              $(AUX_DIR)/$(call &,$0,BUILT_NAME)/%.o.cmd,\
              $(call &,$0,SRC))))
 
-$(call TRACE1,OBJ_$(call &,$0,BUILT_NAME) := $(strip \
-  $(patsubst $(SRC_DIR)/$(call &,$0,SOURCE_NAME)%,\
+$(call EMIT1,OBJ_$(call &,$0,BUILT_NAME) := $$(call SLOWEST_FIRST,$(strip \
+  $(patsubst $(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME)%,\
              $(RES_DIR)/$(call &,$0,BUILT_NAME)/%.o,\
-             $(call &,$0,SRC))))
+             $(call &,$0,SRC)))))
 
+ifneq ($(EXPLICIT_RULES),y)
 $$(OBJ_$(call &,$0,BUILT_NAME)): \
   $(RES_DIR)/$(call &,$0,BUILT_NAME)/%.o: \
-  $(call NORM_PATH,$(DU_DIR)/$(call &,$0,SOURCE_NAME))/%.did_update \
-| $(call NORM_PATH,$(SRC_DIR)/$(call &,$0,SOURCE_NAME))/% \
+  $(call NORM_PATH,$(call &,$0,MARKER_DIR)/$(call &,$0,SOURCE_NAME))/%.did_update \
+| $(call NORM_PATH,$(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME))/% \
   $$(DIRECTORY)
+endif
+
+$(if $(strip $(call &,$0,PREREQUISITES)),\
+  $$(OBJ_$(call &,$0,BUILT_NAME)): $(call &,$0,PREREQUISITES))
 
 $(OBJ_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
   --target $$@ --prerequisites $$? -- \
   --build-dir $(BUILD_DIR)
 
+ifneq ($(EXPLICIT_RULES),y)
 $$(OBJ_$(call &,$0,BUILT_NAME)_CMD): \
   $(AUX_DIR)/$(call &,$0,BUILT_NAME)/%.o.cmd: \
-  $(call NORM_PATH,$(DU_DIR)/$(call &,$0,SOURCE_NAME))/%.did_update \
+  $(call NORM_PATH,$(call &,$0,MARKER_DIR)/$(call &,$0,SOURCE_NAME))/%.did_update \
   $(THIS_MAKEFILE) \
-| $(call NORM_PATH,$(SRC_DIR)/$(call &,$0,SOURCE_NAME))/% \
+| $(call NORM_PATH,$(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME))/% \
   $$(DIRECTORY)
-> echo '$$(COMPILE_OBJECT)' > $$@
+> $(call WRITE_COMMAND,COMPILE_OBJECT)
+endif
+
+$(if $(filter y,$(EXPLICIT_RULES)),$(call EXPLICIT_OBJECTS,\
+  $(patsubst $(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME)%,%,$(call &,$0,SRC)),\
+  $(RES_DIR)/$(call &,$0,BUILT_NAME)/,\
+  $(call NORM_PATH,$(call &,$0,MARKER_DIR)/$(call &,$0,SOURCE_NAME))/,\
+  $(call NORM_PATH,$(call &,$0,SOURCE_DIR)/$(call &,$0,SOURCE_NAME))/))
 
 .PRECIOUS: $$(OBJ_$(call &,$0,BUILT_NAME)_CMD)
 
 $(OBJ_$(call &,$0,BUILT_NAME)_CMD): CFLAGS := $(call &,$0,CFLAGS)
-$(OBJ_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
+
+DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME) := $$(patsubst \
+  $(call NORM_PATH,./$(RES_DIR))/%,\
+  $(call NORM_PATH,./$(DU_DIR)/)/%.did_update,\
+  $$(OBJ_$(call &,$0,BUILT_NAME)))
+
+$(HASHED_CHAIN_RULES)
+endef
+
+# Unity builds.
+# Compiling each source on its' own parses the same headers over and over.
+# With this, sources of a program are compiled together instead: they're
+#   split between UNITY_UNITS translation units (as many as there are
+#   cores, by default), and headers are parsed once per unit.
+# Enable it for all programs like this:
+# make UNITY=y
+#   or for some of them, by setting UNITY before their' PROGRAM calls.
+# Sources have to be fit for this: static functions and macros of
+#   a source are seen by the sources after it in the unit.
+#
+# Units are generated in build/aux/<program>/.unity/unity-<N>.c, and
+#   include sources by absolute path. They're written only when their'
+#   contents change, so they're tracked like any other source, and
+#   the sources included are tracked like headers (see HEADER_MARKERS).
+# Sources are split by unity.awk: it balances the units by the history
+#   of compile durations, or by size of sources not compiled yet.
+#   The split is kept in build/aux/<program>/.unity/units.mk, and only
+#   new sources are placed when sources of the program change:
+#   the rest stay in their' units, which aren't compiled again.
+#
+# Compiling a whole unit on each edit of a source would make incremental
+#   builds slow. So the sources listed by UNITY_ISOLATE (changed or added
+#   since the last commit, if it's a git repository) are taken out of
+#   their' units and compiled on their' own. The unit is compiled again
+#   when a source leaves it or comes back, and in between, edits of
+#   the source compile just the source.
+# A source coming back may have changed while the unit didn't include it,
+#   so its' marker holds a digest older than the source. So when the unit
+#   is compiled, digests of its' sources (UNITY_SOURCES) are recorded
+#   in their' markers. Without the native module, that's left to the next
+#   build, which compiles the unit once more.
+UNITY := n
+UNITY_UNITS := $(JOBS)
+UNITY_ISOLATE := git ls-files --modified --others --exclude-standard 2>/dev/null
+
+# Sources listed by UNITY_ISOLATE: the command runs once, when it's needed.
+UNITY_ISOLATED = $(eval UNITY_ISOLATED := $$(call PLAIN_SHELL,$$(UNITY_ISOLATE)))$(UNITY_ISOLATED)
+
+# Function: Numbers from 1 to $1, which is more than zero.
+define COUNT_TO
+$(if $(word $1,$2),$(strip $2),$(call COUNT_TO,$1,$2 $(words x $2)))
+endef
+
+# Function: Define build of units of a program (see UNITY).
+# Parameters are the same as first four parameters of PROGRAM, and
+#   the 5th one is as the 7th one of OBJECTS.
+# Rules of objects of the sources themselves are defined by OBJECTS
+#   as usual: isolated sources are compiled by them. Objects of units
+#   go to build/res/<program>/.unity/.
+# Which objects are linked is decided by UNITY_SPLIT when the rules are
+#   read: the isolated sources aren't the same from run to run.
+define UNITY_OBJECTS
+$(call FUNCTION_DEBUG_HEADER,$0)
+$(call let,$0,SOURCE_NAME,$1)
+$(call let,$0,BUILT_NAME,$2)
+$(call let,$0,SRC,$3)
+$(call let,$0,CFLAGS,$4)
+$(call let,$0,PREREQUISITES,$5)
+$(call let,$0,NUMBERS,$(call COUNT_TO,$(words $(wordlist 1,$(UNITY_UNITS),$(call &,$0,SRC)))))
+
+$(call OBJECTS,\
+       $(call &,$0,BUILT_NAME)/.unity,\
+       $(call &,$0,BUILT_NAME)/.unity,\
+       $(patsubst %,$(AUX_DIR)/$(call &,$0,BUILT_NAME)/.unity/unity-%.c,$(call &,$0,NUMBERS)),\
+       $(call &,$0,CFLAGS),\
+       $(AUX_DIR),\
+       $(DU_DIR),\
+       $(call &,$0,PREREQUISITES))
+
+$$(eval $$(call UNITY_SPLIT,$(call &,$0,BUILT_NAME),$(call &,$0,NUMBERS),$(SRC_DIR)/$(call &,$0,SOURCE_NAME),$(call &,$0,SRC)))
+endef
+
+# Function: Split sources $4 of program $1 between units $2, unless
+#   they're split already, and write the units without isolated sources.
+# The split is read with $(file): if it were included, Make would look
+#   for a way to remake it.
+# $3 is the prefix of sources, which OBJECTS replaces with the directory
+#   of objects.
+# Expands to the lists of objects to link: objects of units, and of the
+#   isolated sources.
+define UNITY_SPLIT
+$(call let,$0,BUILT_NAME,$1)
+$(call let,$0,NUMBERS,$2)
+$(call let,$0,PREFIX,$3)
+$(call let,$0,SRC,$4)
+$(call let,$0,DIR,$(AUX_DIR)/$(call &,$0,BUILT_NAME)/.unity)
+$(eval $(file <$(call &,$0,DIR)/units.mk))
+$(if $(and \
+  $(call EQUAL,$(call &,$0,NUMBERS),$(UNITY_$(call &,$0,BUILT_NAME)_NUMBERS)),\
+  $(call EQUAL,$(sort $(call &,$0,SRC)),$(sort $(foreach K,$(call &,$0,NUMBERS),$(UNITY_$(call &,$0,BUILT_NAME)_$K))))),,\
+  $(call UNITY_PARTITION,$(call &,$0,DIR),$(call &,$0,BUILT_NAME),$(call &,$0,NUMBERS),$(call &,$0,PREFIX),$(call &,$0,SRC))\
+  $(eval $(file <$(call &,$0,DIR)/units.mk)))
+$(foreach K,$(call &,$0,NUMBERS),\
+  $(call WRITE_CHANGED,$(call &,$0,DIR)/unity-$K.c,\
+    $(call UNITY_INCLUDES,$(filter-out $(UNITY_ISOLATED),$(UNITY_$(call &,$0,BUILT_NAME)_$K))))\
+  $(patsubst $(RES_DIR)/%,$(AUX_DIR)/%.did_update,\
+    $(filter %/unity-$K.c.o,$(OBJ_$(call &,$0,BUILT_NAME)/.unity))): \
+    private UNITY_SOURCES := $(filter-out $(UNITY_ISOLATED),$(UNITY_$(call &,$0,BUILT_NAME)_$K))$(NEWLINE))
+OBJ_$(call &,$0,BUILT_NAME) := $(call SLOWEST_FIRST,\
+  $(OBJ_$(call &,$0,BUILT_NAME)/.unity) \
+  $(patsubst $(call &,$0,PREFIX)%,$(RES_DIR)/$(call &,$0,BUILT_NAME)/%.o,\
+             $(filter $(UNITY_ISOLATED),$(call &,$0,SRC))))
+DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME) := $$(patsubst $(RES_DIR)/%,$(AUX_DIR)/%.did_update,$$(OBJ_$(call &,$0,BUILT_NAME)))
+endef
+
+# Function: Run unity.awk to split sources $5 of program $2 between
+#   units $3, keeping the split in directory $1. $4 is as in UNITY_SPLIT.
+# The list of sources is passed in a file: it may be too long
+#   for a command line.
+define UNITY_PARTITION
+$(if $(wildcard $1),,$(call PLAIN_SHELL,mkdir -p $1))
+$(file >$1/sources,$5)
+$(call PLAIN_SHELL,tr ' ' '\n' < $1/sources | xargs wc -c \
+        | awk -f $(QAKE_INCLUDE_DIR)/unity.awk \
+              -v NAME=$2 -v UNITS='$3' \
+              -v SOURCE_PREFIX=$4 -v OBJECT_PREFIX=$(RES_DIR)/$2/ \
+              $(wildcard $(DURATIONS) $1/units.mk) - > $1/units.mk.new \
+        && mv $1/units.mk.new $1/units.mk)
+endef
+
+# Function: $(shell $1) while the rules are read.
+# OBJECTS sets .SHELLFLAGS for recipes, which $(shell) would use too.
+define PLAIN_SHELL
+$(eval PLAIN_SHELL_FLAGS := $$(value .SHELLFLAGS))\
+$(eval .SHELLFLAGS := --phony)\
+$(shell $1)\
+$(eval .SHELLFLAGS = $(PLAIN_SHELL_FLAGS))
+endef
+
+# Function: Unity translation unit including the sources $1.
+define UNITY_INCLUDES
+$(foreach SOURCE,$1,#include "$(abspath $(SOURCE))"$(NEWLINE))
+endef
+
+# Function: Write $2 into the file $1, unless it's there already:
+#   the file keeps its' modification time then.
+define WRITE_CHANGED
+$(if $(and $(wildcard $1),$(call EQUAL,$(strip $2),$(strip $(file <$1)))),,$(file >$1,$2))
+endef
+
+# Precompiled headers.
+# Most of the time of compiling a source may go to parsing the headers
+#   it includes, and these are mostly the same for all sources of
+#   a program. So a header including them may be compiled once, and each
+#   source then starts from the compiled state. Pass the header as
+#   the 8th parameter of PROGRAM:
+# $(eval $(call PROGRAM,,circled,$(SRC),,,,,src/circle.h))
+# What's compiled is build/res/<program>/<header>, which just includes
+#   the header. It's compiled with CFLAGS of the program into
+#   build/res/<program>/<header>.gch, and objects of the program are
+#   compiled with '-include build/res/<program>/<header>': gcc takes
+#   the .gch in place of it. The preprocessor alone (see FINGERPRINT and
+#   CACHE) can't use the .gch, and reads the header instead.
+# Sources may include the header as usual, as long as it has
+#   an include guard.
+# The language is told by the extension of the header, as gcc does:
+#   name C++ headers .hh, .hpp and so on.
+#
+# The .gch is tracked like objects are: its' command is kept in a .cmd
+#   file, headers it includes are recorded in DEPS_STORE, and objects
+#   depend on its' marker.
+# gcc never writes the same .gch twice, so each compilation of the header
+#   compiles all objects of the program again. That's why the header is
+#   always compiled through cache.sh with a fingerprint: if it and
+#   the headers it includes have the same tokens as last time,
+#   the .gch is left as it was (see COMPILE_HEADER).
+
+# The stub includes the header by its' absolute path, so it's written
+#   while the rules are read, like units of unity builds are: a moved or
+#   copied project includes its' own header. The rule only writes it
+#   the first time, when there's no directory for it yet.
+
+# Function: Text of the stub including the header $1.
+define HEADER_STUB_TEXT
+#include "$(abspath $1)"
+endef
+
+# Function: Define build of the precompiled header $2 out of the header $1
+#   with flags $3.
+define PRECOMPILED_HEADER
+$(call FUNCTION_DEBUG_HEADER,$0)
+$(call let,$0,HEADER,$1)
+$(call let,$0,PCH,$2)
+$(call let,$0,CFLAGS,$3)
+$(call let,$0,PCH_CMD,$(patsubst $(RES_DIR)/%,$(AUX_DIR)/%.cmd,$(call &,$0,PCH)))
+$(call let,$0,STUB,$(basename $(call &,$0,PCH)))
+
+$$(if $$(wildcard $(dir $(call &,$0,STUB))),$$(call WRITE_CHANGED,$(call &,$0,STUB),$$(call HEADER_STUB_TEXT,$(call &,$0,HEADER))))
+
+$(call &,$0,STUB): | $$(DIRECTORY)
+> $$(file >$$@,$$(call HEADER_STUB_TEXT,$(call &,$0,HEADER)))
+
+$(call &,$0,PCH): $(call HEADER_MARKERS,$(call &,$0,HEADER))
+
+$(call &,$0,PCH_CMD): \
+  $(call HEADER_MARKERS,$(call &,$0,HEADER)) \
+  $(THIS_MAKEFILE) \
+| $(call &,$0,STUB) \
+  $$(DIRECTORY)
+> $(call WRITE_COMMAND,COMPILE_HEADER)
+
+.PRECIOUS: $(call &,$0,PCH_CMD)
+
+$(call &,$0,PCH_CMD): CFLAGS := $(call &,$0,CFLAGS)
+$(call &,$0,PCH_CMD): .SHELLFLAGS = \
   --target $$@ --prerequisites $$? -- \
   --build-dir $(BUILD_DIR)
-$$(eval $$(call DEFINE_HASHED_CHAIN, \
-                OBJ_$$(call &,$0,BUILT_NAME), \
-                $(call NORM_PATH,./$(RES_DIR))/%, \
-                $(call NORM_PATH,./$(DU_DIR)/)/%, \
-                $$(OBJ_$(call &,$0,BUILT_NAME))))
-
-$$(eval $$(call DEFINE_HASHED_CHAIN, \
-                SRC_$$(call &,$0,SOURCE_NAME), \
-                $(call NORM_PATH,./$(call &,$0,SOURCE_NAME))/%, \
-                $(call NORM_PATH,$(DU_DIR)/$(call &,$0,SOURCE_NAME))/%, \
-                $$(call &,$0,SRC)))
+endef
 
-.PRECIOUS: build/aux/%.did_update
+# Cache of expanded rules.
+# Expansion of PROGRAM and libraries (all these let's, NORM_PATH's and
+#   so on) is what takes most of the time Make spends reading Makefiles
+#   of a large project, and it's the same from run to run.
+# So the expanded text is written to $(GENERATED_DIR)/<name>.<function>.mk,
+#   and the function expands to 'include' of that file.
+# Next time, if the key is the same, the file is just included again.
+# The key (kept in %.mk.key) consists of:
+#   - arguments of the function, source lists included;
+#   - names and hashes of Makefiles read so far, prologue.mk included;
+#   - variables given on command line, and whether the native module
+#     is loaded: they change the rules, too;
+#   - the directory of the project: a moved or copied one doesn't take
+#     rules expanded for the old place.
+# Everything the text refers to has to be in the text: see EMIT1.
+# Hashes are computed by the native module; without it, there's no cache,
+#   as hashing in the shell would cost more than the expansion for small
+#   projects.
+# To disable, do:
+# make RULES_CACHE=n
+RULES_CACHE := y
+GENERATED_DIR := $(AUX_DIR)/generated
 
-$(AUX_DIR)/%.did_update: \
-$(AUX_DIR)/%.hash.new
->  if [ -f $$(patsubst %.hash.new,\
-                       %.hash.old,\
-                       $$<) ];\
-   then \
-     if ! diff -q $$< $$(patsubst %.hash.new,\
-                                  %.hash.old,\
-                                  $$<) > /dev/null; \
-     then \
-         touch $$@; \
-     fi; \
-   else \
-     touch $$@; \
-   fi; \
-   cp $$< $$(patsubst %.hash.new,\
-                      %.hash.old,\
-                      $$<)
+# Makefiles the rules depend on: not the .d files or the cached rules.
+RULES_CACHE_MAKEFILES = $(filter-out $(AUX_DIR)/%,$(MAKEFILE_LIST))
 
-.PRECIOUS: build/aux/%.hash.new
+define RULES_KEY
+$(strip \
+  $(MAKEOVERRIDES) $(QAKE_MODULE) $(CURDIR) \
+  $(RULES_CACHE_MAKEFILES) $(qake-hash $(RULES_CACHE_MAKEFILES)) \
+  $1 | $2 | $3 | $4 | $5 | $6 | $7 | $8 | $9)
+endef
 
-$(AUX_DIR)/%.hash.new: \
-  $(RES_DIR)/% \
-| $$(DIRECTORY)
-> $(HASH) $$< > $$@
+# Function: Expand the function $1 with arguments $2... through the cache.
+define CACHED_RULES
+$(if $(and $(filter y,$(RULES_CACHE)),$(QAKE_MODULE)),\
+  $(call CACHED_RULES_INCLUDE,\
+         $(GENERATED_DIR)/$(strip $3).$1.mk,\
+         $(call RULES_KEY,$1,$2,$3,$4,$5,$6,$7,$8,$9),\
+         $1,$2,$3,$4,$5,$6,$7,$8,$9),\
+  $(call $1,$2,$3,$4,$5,$6,$7,$8,$9))
+endef
 
-$(AUX_DIR)/%.hash.new: \
-  $(SRC_DIR)/% \
-| $$(DIRECTORY)
-> $(HASH) $$< > $$@
+# Function: Write the file $1 with the rules unless it has the key $2,
+#   and include it. The rest are the function and its' arguments.
+define CACHED_RULES_INCLUDE
+$(if $(call EQUAL,$2,$(file <$(strip $1).key)),,\
+  $(if $(wildcard $(GENERATED_DIR)),,$(shell mkdir -p $(GENERATED_DIR)))\
+  $(file >$(strip $1),$(call $3,$4,$5,$6,$7,$8,$9,$(10),$(11)))\
+  $(file >$(strip $1).key,$2))
+include $(strip $1)
+endef
 
-$(AUX_DIR)/%.hash.new: \
-  $(AUX_DIR)/% \
-| $$(DIRECTORY)
-> $(HASH) $$< > $$@
+# Function: Define build of a program.
+#
+# TODO: Update this documentation.
+#   It currently doesn't describe command tracking and dependencies hashing.
+#
+# Suppose we're calling this function as follows:
+# $(call PROGRAM,a,b,c.c,d,e,f)
+# (such flags make no sense, but we don't care, it's an example)
+#
+# Objects are defined by OBJECTS (see above).
+# It first defines variable OBJ_b := build/c.c.o
+#
+# Then it defines static pattern rule for objects:
+# $(OBJ_b): build/%.o: \
+#   src/% \
+# | $(DIRECTORY)
+# > $(COMPILE_OBJECT)
+#
+# Details:
+# https://www.gnu.org/software/make/manual/html_node/Static-Pattern.html
+#
+# Then we specify CFLAGS for these objects via target-specific variable assignment:
+# https://www.gnu.org/software/make/manual/html_node/Target_002dspecific.html
+#
+# Headers on which objects depend are listed by GCC while compiling,
+#   and collected in a single store (see DEPS_STORE).
+#
+# Next, we define $(PROGRAM_b): $(OBJ_b) to specify prerequisites of program
+#   and its' recipe on next line.
+# LDFLAGS and LDLIBS are also specified in target-specific manner.
+#
+# If the program is linked with libraries built by SHARED_LIBRARY or
+#   STATIC_LIBRARY, their' names are passed as the 7th parameter.
+# The program is relinked only when a library changes meaningfully
+#   (see these functions). Libraries are looked up by name with secondary
+#   expansion, so they may be defined after the program.
+#
+# A header to precompile for all objects of the program may be passed
+#   as the 8th parameter (see PRECOMPILED_HEADER).
+#
+# Finally, we do ALL += $(PROGRAM_b) to make 'all' target build this program.
+#
+# You can see all the generated goodness by replacing
+#   $(eval $(call PROGRAM, ...)) with
+#   $(info $(call PROGRAM_RULES, ...))
+# (PROGRAM itself expands to include of the cached rules, see CACHED_RULES).
+define PROGRAM_RULES
+$(call FUNCTION_DEBUG_HEADER,$0)
+$(call let,$0,SOURCE_NAME,$1)
+$(call let,$0,BUILT_NAME,$2)
+$(call let,$0,SRC,$3)
+$(call let,$0,CFLAGS,$4)
+$(call let,$0,LDFLAGS,$5)
+$(call let,$0,LDLIBS,$6)
+$(call let,$0,LIBRARIES,$7)
+$(call let,$0,HEADER,$(strip $8))
+$(call let,$0,PCH,$(if $(call &,$0,HEADER),$(strip \
+  $(RES_DIR)/$(call &,$0,BUILT_NAME)/$(notdir $(call &,$0,HEADER)).gch)))
+$(call let,$0,OBJECT_CFLAGS,$(strip \
+  $(if $(call &,$0,PCH),-include $(basename $(call &,$0,PCH))) $(call &,$0,CFLAGS)))
+
+$(call OBJECTS,\
+       $(call &,$0,SOURCE_NAME),\
+       $(call &,$0,BUILT_NAME),\
+       $(call &,$0,SRC),\
+       $(call &,$0,OBJECT_CFLAGS),\
+       ,\
+       ,\
+       $(patsubst $(RES_DIR)/%,$(AUX_DIR)/%.did_update,$(call &,$0,PCH)))
 
-$(call TRACE1,DEP_$(call &,$0,BUILT_NAME) := $(strip \
-  $$(patsubst $(call NORM_PATH,$(RES_DIR)/$(BUILT_NAME))/%,$(call NORM_PATH,$(AUX_DIR)/$(BUILT_NAME))/%.d,$$(OBJ_$(call &,$0,BUILT_NAME)))))
+$(if $(call &,$0,PCH),$(call PRECOMPILED_HEADER,\
+       $(call &,$0,HEADER),\
+       $(call &,$0,PCH),\
+       $(call &,$0,CFLAGS)))
 
--include $$(DEP_$(call &,$0,BUILT_NAME))
+$(if $(and $(filter y,$(UNITY)),$(call &,$0,SRC)),$(call UNITY_OBJECTS,\
+       $(call &,$0,SOURCE_NAME),\
+       $(call &,$0,BUILT_NAME),\
+       $(call &,$0,SRC),\
+       $(call &,$0,OBJECT_CFLAGS),\
+       $(patsubst $(RES_DIR)/%,$(AUX_DIR)/%.did_update,$(call &,$0,PCH))))
 
-$(call TRACE1,PROGRAM_$(call &,$0,BUILT_NAME)_CMD := $(strip \
+$(call EMIT1,PROGRAM_$(call &,$0,BUILT_NAME)_CMD := $(strip \
   $(AUX_DIR)/$(call &,$0,BUILT_NAME)/$(call &,$0,BUILT_NAME)).cmd)
 
-$(call TRACE1,PROGRAM_$(call &,$0,BUILT_NAME) := $(strip \
+$(call EMIT1,PROGRAM_$(call &,$0,BUILT_NAME) := $(strip \
   $(RES_DIR)/$(call &,$0,BUILT_NAME)/$(call &,$0,BUILT_NAME)))
 
 $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): \
   $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
   $(THIS_MAKEFILE) \
-| $$(OBJ_$(call &,$0,BUILT_NAME))
-> echo '$$(LINK_PROGRAM)' > $$@
+| $$(OBJ_$(call &,$0,BUILT_NAME)) \
+  $$$$(call LIBRARY_FILES,$(call &,$0,LIBRARIES))
+> $(call WRITE_COMMAND,LINK_PROGRAM)
 
 $$(PROGRAM_$(call &,$0,BUILT_NAME)): \
   $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
-| $$(OBJ_$(call &,$0,BUILT_NAME))
+  $$$$(call LIBRARY_MARKERS,$(call &,$0,LIBRARIES)) \
+| $$(OBJ_$(call &,$0,BUILT_NAME)) \
+  $$$$(call LIBRARY_FILES,$(call &,$0,LIBRARIES))
 
 .PRECIOUS: $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD)
 
 $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): LDFLAGS := $(call &,$0,LDFLAGS)
 $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): LDLIBS := $(call &,$0,LDLIBS)
+$$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): LIBRARIES = \
+  $$(call LIBRARY_FILES,$(call &,$0,LIBRARIES))
 $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
   --target $$@ --prerequisites $$? -- \
   --build-dir $(BUILD_DIR)
@@ -489,27 +1346,247 @@ $$(PROGRAM_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
 ALL += $$(PROGRAM_$(call &,$0,BUILT_NAME))
 endef
 
-# Funcion: define variables containing file paths
-#   of 'did update' markers and hashes.
-define DEFINE_HASHED_CHAIN
-$(strip \
+# Expanded rules are cached, see CACHED_RULES.
+define PROGRAM
+$(call CACHED_RULES,PROGRAM_RULES,$1,$2,$3,$4,$5,$6,$7,$8)
+endef
+
+# Function: Define build of a shared library.
+#
+# Parameters are the same as for PROGRAM, except there's no 7th one.
+# Objects are compiled with -fPIC, and linked to
+#   build/res/<name>/lib<name>.so, with 'lib<name>.so' as SONAME.
+# Programs are linked with the library when its' name is passed to PROGRAM
+#   (LIBRARY_FILE_<name> and LIBRARY_MARKER_<name> tell PROGRAM what to use):
+# $(eval $(call SHARED_LIBRARY,core,core,$(SRC_CORE),,,))
+# $(eval $(call PROGRAM,app,app,$(SRC_APP),,,,core))
+# The library's directory is put into RPATH of the program,
+#   so it runs right from the build directory.
+#
+# Usually, every change of a library relinks every program linked with it.
+# That's not needed: the program only records which symbols it takes from
+#   the library, and the code is loaded at run time.
+# So programs don't depend on the library's %.did_update marker,
+#   but on %.abi.did_update one, which is touched only when SONAME
+#   or the set of exported symbols changes (see native/object.c).
+define SHARED_LIBRARY_RULES
 $(call FUNCTION_DEBUG_HEADER,$0)
-$(call let,$0,VAR_NAME_SUFFIX,$1)
-$(call let,$0,SOURCE_PATTERN,$2)
-$(call let,$0,TARGET_PATTERN,$3)
-$(call let,$0,SOURCE_LIST,$4)
-)
-DID_UPDATE_$$(call &,$0,VAR_NAME_SUFFIX) = $$(strip \
-  $$(patsubst $(call &,$0,SOURCE_PATTERN),\
-              $(call &,$0,TARGET_PATTERN).did_update, \
-              $(call &,$0,SOURCE_LIST)))
+$(call let,$0,SOURCE_NAME,$1)
+$(call let,$0,BUILT_NAME,$2)
+$(call let,$0,SRC,$3)
+$(call let,$0,CFLAGS,$4)
+$(call let,$0,LDFLAGS,$5)
+$(call let,$0,LDLIBS,$6)
+
+$(call OBJECTS,\
+       $(call &,$0,SOURCE_NAME),\
+       $(call &,$0,BUILT_NAME),\
+       $(call &,$0,SRC),\
+       -fPIC $(call &,$0,CFLAGS))
 
-HASH_NEW_$$(call &,$0,VAR_NAME_SUFFIX) = $$(strip \
-  $$(patsubst $(call &,$0,SOURCE_PATTERN),\
-              $(call &,$0,TARGET_PATTERN).hash.new, \
-              $(call &,$0,SOURCE_LIST)))
+$(call EMIT1,SHARED_LIBRARY_$(call &,$0,BUILT_NAME) := $(strip \
+  $(RES_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).so))
+
+$(call EMIT1,SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD := $(strip \
+  $(AUX_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).so.cmd))
+
+$(call EMIT1,LIBRARY_FILE_$(call &,$0,BUILT_NAME) := $(strip \
+  $(SHARED_LIBRARY_$(call &,$0,BUILT_NAME))))
+
+$(call EMIT1,LIBRARY_MARKER_$(call &,$0,BUILT_NAME) := $(strip \
+  $(AUX_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).so.abi.did_update))
+
+$$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): \
+  $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
+  $(THIS_MAKEFILE) \
+| $$(OBJ_$(call &,$0,BUILT_NAME))
+> $(call WRITE_COMMAND,LINK_SHARED_LIBRARY)
+
+$$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)): \
+  $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
+| $$(OBJ_$(call &,$0,BUILT_NAME))
+
+.PRECIOUS: $$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD)
+
+$$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): LDFLAGS := $(call &,$0,LDFLAGS)
+$$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): LDLIBS := $(call &,$0,LDLIBS)
+$$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
+  --target $$@ --prerequisites $$? -- \
+  --build-dir $(BUILD_DIR)
+
+ALL += $$(SHARED_LIBRARY_$(call &,$0,BUILT_NAME))
+endef
+
+# Expanded rules are cached, see CACHED_RULES.
+define SHARED_LIBRARY
+$(call CACHED_RULES,SHARED_LIBRARY_RULES,$1,$2,$3,$4,$5,$6)
 endef
 
+# Function: Define build of a static library.
+#
+# Parameters are the same as for SHARED_LIBRARY, except there are no
+#   linker flags: nothing is linked.
+# Objects are archived to build/res/<name>/lib<name>.a, see archive.sh.
+#
+# The archive isn't recreated on each change: only objects which did
+#   change are replaced in it. These are found out from $? - updated
+#   prerequisites of the archive, which are 'did update' markers of objects.
+# If the command itself changed (say, a source was removed),
+#   the archive is created anew.
+# That's why the archive has its' own recipe instead of the one of
+#   $(RES_DIR)/% rule: the list is passed in UPDATED variable to the command.
+#
+# The archive is thin: it only refers to its' objects, so its' bytes
+#   don't change with their' code. Programs depend on the usual
+#   %.did_update marker of the archive, for its' members and index, and
+#   on the markers of the objects, so they're relinked only when code
+#   of some member actually changes.
+define STATIC_LIBRARY_RULES
+$(call FUNCTION_DEBUG_HEADER,$0)
+$(call let,$0,SOURCE_NAME,$1)
+$(call let,$0,BUILT_NAME,$2)
+$(call let,$0,SRC,$3)
+$(call let,$0,CFLAGS,$4)
+
+$(call OBJECTS,\
+       $(call &,$0,SOURCE_NAME),\
+       $(call &,$0,BUILT_NAME),\
+       $(call &,$0,SRC),\
+       $(call &,$0,CFLAGS))
+
+$(call EMIT1,STATIC_LIBRARY_$(call &,$0,BUILT_NAME) := $(strip \
+  $(RES_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).a))
+
+$(call EMIT1,STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD := $(strip \
+  $(AUX_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).a.cmd))
+
+$(call EMIT1,LIBRARY_FILE_$(call &,$0,BUILT_NAME) := $(strip \
+  $(STATIC_LIBRARY_$(call &,$0,BUILT_NAME))))
+
+$(call EMIT1,LIBRARY_MARKER_$(call &,$0,BUILT_NAME) := $(strip \
+  $(AUX_DIR)/$(call &,$0,BUILT_NAME)/lib$(call &,$0,BUILT_NAME).a.did_update \
+  $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME))))
+
+$$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): \
+  $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
+  $(THIS_MAKEFILE) \
+| $$(OBJ_$(call &,$0,BUILT_NAME))
+> $(call WRITE_COMMAND,ARCHIVE_STATIC_LIBRARY)
+
+$$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)): \
+  $$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD).did_update \
+  $$(DID_UPDATE_OBJ_$(call &,$0,BUILT_NAME)) \
+| $$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD) \
+  $$(OBJ_$(call &,$0,BUILT_NAME)) \
+  $$(DIRECTORY)
+> export UPDATED='$$(if $$(filter %.cmd.did_update,$$?),,$$(filter %.o,$$(patsubst $(AUX_DIR)/%.did_update,$(RES_DIR)/%,$$?)))'; \
+  eval $$$$(cat $$(firstword $$|))
+
+.PRECIOUS: $$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD)
+
+$$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME)_CMD): .SHELLFLAGS = \
+  --target $$@ --prerequisites $$? -- \
+  --build-dir $(BUILD_DIR)
+
+ALL += $$(STATIC_LIBRARY_$(call &,$0,BUILT_NAME))
+endef
+
+# Expanded rules are cached, see CACHED_RULES.
+define STATIC_LIBRARY
+$(call CACHED_RULES,STATIC_LIBRARY_RULES,$1,$2,$3,$4)
+endef
+
+# Function: Paths of libraries with given names.
+define LIBRARY_FILES
+$(foreach LIBRARY,$1,$(LIBRARY_FILE_$(LIBRARY)))
+endef
+
+# Function: Paths of markers, which are touched when libraries with given
+#   names change in a way that matters to programs linked with them.
+# A static library has several: see STATIC_LIBRARY.
+define LIBRARY_MARKERS
+$(foreach LIBRARY,$1,$(LIBRARY_MARKER_$(LIBRARY)))
+endef
+
+# Cache of build results, shared by all build directories
+#   (see cache.sh for details).
+# Objects and programs built before - in another worktree, clone,
+#   on another branch or just before 'rm -rf build' - are restored from it
+#   instead of being built again.
+# It's disabled by default, as it costs an additional run of preprocessor
+#   for each compiled object, and it's never cleaned up automatically.
+# Enable it like this:
+# make CACHE=y
+# To clean it, just remove CACHE_DIR.
+CACHE := n
+CACHE_DIR := $(or $(XDG_CACHE_HOME),$(HOME)/.cache)/qake
+
+ifeq ($(CACHE),y)
+CACHE_OPTIONS := --cache-dir $(CACHE_DIR)
+CACHED_LINK := $(QAKE_INCLUDE_DIR)/cache.sh $(CACHE_OPTIONS) --
+endif
+
+# Pruning of meaningless changes before compilation.
+# Usually, changed source is compiled, and the change is pruned only if
+#   the object turns out to be the same - so only linking is saved.
+# With this, cache.sh computes a fingerprint of the tokens of preprocessed
+#   source first, and compilation is skipped if it's the same as last time.
+# So edits of comments and formatting cost a preprocessor run,
+#   not a compiler one. Same goes for headers.
+# It's disabled by default because of that preprocessor run, which is wasted
+#   for meaningful changes. Enable it like this:
+# make FINGERPRINT=y
+# Fingerprints are kept next to dependency files, in %.o.fingerprint.
+# It is expanded in the recipe of %.o.cmd, where $@ is the command file.
+FINGERPRINT := n
+
+ifeq ($(FINGERPRINT),y)
+FINGERPRINT_OPTIONS = \
+  --fingerprint $(AUX_DIR)/$(call GET_TARGET_PATH,$@).fingerprint
+endif
+
+CACHED_COMPILE = $(if $(CACHE_OPTIONS)$(FINGERPRINT_OPTIONS),\
+  $(QAKE_INCLUDE_DIR)/cache.sh $(CACHE_OPTIONS) $(FINGERPRINT_OPTIONS) \
+                               --preprocess --)$(if $(WORKER_COMPILE), $(WORKER_COMPILE))
+
+# Pool of processes compiling objects (see native/worker.c).
+# Each compile is preprocessed here and shipped to the pool by the hash of
+#   preprocessed source; the object comes back by its' hash. The pool runs
+#   compilers without a shell, and stays up between builds: it's started
+#   here when it isn't running, and exits after WORKER_IDLE seconds
+#   without work, or when the build directory is removed.
+# The pool doesn't need the project's files, so it may as well run on
+#   a build host: point WORKER_SOCKET at a socket forwarded there.
+#   Makefiles don't change either way.
+# Enable it like this:
+# make WORKER=y
+# It needs the native helpers. Precompiled headers don't help objects
+#   compiled by the pool: it gets sources already preprocessed.
+# WORKER_JOBS is the number of processes in the pool; the number of cores,
+#   if empty. The pool keeps sources and objects up to WORKER_STORE_SIZE
+#   megabytes, and only runs WORKER_COMPILERS: anyone reaching its' socket
+#   may use it.
+WORKER := n
+WORKER_SOCKET := $(AUX_DIR)/worker.sock
+WORKER_STORE := $(AUX_DIR)/worker
+WORKER_JOBS :=
+WORKER_IDLE := 600
+WORKER_STORE_SIZE := 1024
+WORKER_COMPILERS := gcc
+
+ifeq ($(WORKER),y)
+ifeq (,$(wildcard $(QAKE_INCLUDE_DIR)/native/qake-worker))
+$(error WORKER=y needs native helpers: make -C $(QAKE_INCLUDE_DIR)/native)
+endif
+WORKER_COMPILE := $(QAKE_INCLUDE_DIR)/native/qake-worker \
+  --compile $(WORKER_SOCKET) --
+$(call PLAIN_SHELL,$(QAKE_INCLUDE_DIR)/native/qake-worker \
+  --serve $(WORKER_SOCKET) $(WORKER_STORE) \
+  $(if $(WORKER_JOBS),--jobs $(WORKER_JOBS)) --idle $(WORKER_IDLE) \
+  --store-size $(WORKER_STORE_SIZE) \
+  $(addprefix --compiler ,$(WORKER_COMPILERS)))
+endif
+
 # This is called 'canned recipe'.
 # It's essentially a function, which will get its' automatic variables
 #   expanded in the context of target being built.
@@ -518,23 +1595,72 @@ endef
 #
 # $(@F) is file name part of the path of target.
 # $< is first prerequisite of the target.
+# $| is the list of order-only prerequisites: the source comes first there.
 # $@ is the target.
 # More on automatic variables:
 # https://www.gnu.org/software/make/manual/html_node/Automatic-Variables.html
 #
 define COMPILE_OBJECT
-$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),gcc $$(CFLAGS) $$(patsubst $(AUX_DIR)/%.did_update,$(SRC_DIR)/%,$$<) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) -c -MD -MF $(AUX_DIR)/$$(call GET_TARGET_PATH,$$@).d -MP); \
-sed -i -e "s|\\b$(patsubst $(AUX_DIR)/%.did_update,$(SRC_DIR)/%,$<)\\b||g" $(AUX_DIR)/$(call GET_TARGET_PATH,$@).d
+$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),$(CACHED_COMPILE) gcc $$(CFLAGS) $$(firstword $$|) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) -c -MD -MF $(AUX_DIR)/$$(call GET_TARGET_PATH,$$@).d -MP -MT QAKE_DEPS_$(RES_DIR)/$$(call GET_TARGET_PATH,$$@):=)
+endef
+
+# Same for precompiled header: the fingerprint is always checked
+#   (see PRECOMPILED_HEADER).
+define COMPILE_HEADER
+$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),$(QAKE_INCLUDE_DIR)/cache.sh $(CACHE_OPTIONS) --fingerprint $(AUX_DIR)/$$(call GET_TARGET_PATH,$$@).fingerprint --preprocess -- gcc $$(CFLAGS) $$(firstword $$|) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) -MD -MF $(AUX_DIR)/$$(call GET_TARGET_PATH,$$@).d -MP -MT QAKE_DEPS_$(RES_DIR)/$$(call GET_TARGET_PATH,$$@):=)
 endef
 
+# Canned recipe for hashing of the first prerequisite into the target.
+# Full hashing reads entire file, so we look at its' metadata first.
+# Stat tuple recorded during the last hashing is kept in %.stat
+#   next to %.hash.new.
+# If the tuple is the same, the file wasn't touched since then,
+#   and recorded digest is still valid - we just refresh timestamp of it.
+# Otherwise, the file is actually read and hashed, and the tuple is recorded.
+# Stat is taken before hashing: if file changes in between,
+#   recorded tuple won't match next time and we'll hash it again.
+#
+# 'read' is a shell builtin, so comparison doesn't spawn anything.
+#
+# This is used only without the native module: with it, stat tuples are
+#   kept in the hash store together with the digests.
+define HASH_FILE
+STAT="$$($(STAT) $<)"; \
+if [ -f $@ ] && [ -f $(@:.hash.new=.stat) ] \
+   && read -r RECORDED < $(@:.hash.new=.stat) \
+   && [ "$$STAT" = "$$RECORDED" ]; \
+then \
+  touch $@; \
+else \
+  $(HASH_CONTENTS) > $@ && echo "$$STAT" > $(@:.hash.new=.stat); \
+fi
+endef
+
+# Command printing the digest of the first prerequisite.
+# It's overridden for objects with IGNORE_DEBUG_INFO, see above.
+HASH_CONTENTS = $(HASH) $<
+
 # Another canned recipe - for linking program out of objects.
 # We still call 'gcc' instead of direct invocation of 'ld'
 #   since 'gcc' takes care about some additional parameters to 'ld' in many cases.
 # Besides, there's 'collect2' in between of them.
 # Just stick with compiler driver, it does the right thing most of the rime.
 # $^ is all prerequisites of the target.
+# Libraries go after objects, and directories of shared ones are put into
+#   RPATH of the program.
 define LINK_PROGRAM
-$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),gcc $$(LDFLAGS) $$(filter %.o,$$(patsubst $(AUX_DIR)/%.did_update,$(RES_DIR)/%,$$^)) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) $$(LDLIBS))
+$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),$(CACHED_LINK) gcc $$(LDFLAGS) $$(filter %.o,$$(patsubst $(AUX_DIR)/%.did_update,$(RES_DIR)/%,$$^)) $$(LIBRARIES) $$(addprefix -Wl$$(COMMA)-rpath$$(COMMA),$$(abspath $$(dir $$(filter %.so,$$(LIBRARIES))))) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) $$(LDLIBS))
+endef
+
+# Same for shared library. SONAME is the name of the library file.
+define LINK_SHARED_LIBRARY
+$(call RUN,GCC $$(notdir $$(call GET_TARGET_PATH,$$@)),$(CACHED_LINK) gcc -shared -Wl$(COMMA)-soname$(COMMA)$$(notdir $$(call GET_TARGET_PATH,$$@)) $$(LDFLAGS) $$(filter %.o,$$(patsubst $(AUX_DIR)/%.did_update,$(RES_DIR)/%,$$^)) -o $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) $$(LDLIBS))
+endef
+
+# And for static library. Changed objects are passed to archive.sh
+#   in UPDATED environment variable by the recipe of the archive.
+define ARCHIVE_STATIC_LIBRARY
+$(call RUN,AR $$(notdir $$(call GET_TARGET_PATH,$$@)),$(QAKE_INCLUDE_DIR)/archive.sh $(RES_DIR)/$$(call GET_TARGET_PATH,$$@) $$(filter %.o,$$(patsubst $(AUX_DIR)/%.did_update,$(RES_DIR)/%,$$^)))
 endef
 
 # 'clean' just removes entire build directory.
@@ -542,12 +1668,25 @@ endef
 clean:
 > $(call RUN,RM BUILD_DIR,rm -rf $(BUILD_DIR))
 
-# This is a silly implementation of path normalization.
+# Path normalization.
 # We need this because there are paths with optional user-defined components.
 # When these parts of paths are empty, we end up with double slashes and
 #   Make's path pattern matching stops working.
-# FIXME: There should be better ways to do it, as currently it completely
-#   destroys performance (this is called several times per target).
+#
+# It's done with Make text functions only, so nothing is spawned:
+#   we turn slashes into spaces, which splits the path into components.
+#   Empty components (from double slashes) disappear by themselves,
+#   '.' components are filtered out, and the rest is joined back with slashes.
+# Leading slash of absolute path is restored, and empty relative path
+#   becomes '.', just like Python's os.path.normpath does.
+# Unlike os.path.normpath, '..' components are left as is -
+#   we never produce them, and collapsing them needs knowledge about symlinks.
+# Paths with spaces are not supported (Make doesn't support them well anyway).
 define NORM_PATH
-$(shell python -c 'import os, sys; print os.path.normpath(sys.argv[1])' $1)
+$(strip \
+$(eval NORM_PATH_COMPONENTS := $(filter-out .,$(subst /, ,$1)))
+$(if $(filter /%,$(strip $1)),\
+  /$(subst $(SPACE),/,$(NORM_PATH_COMPONENTS)),\
+  $(or $(subst $(SPACE),/,$(NORM_PATH_COMPONENTS)),.))
+)
 endef
@@ -2,11 +2,18 @@
 
 QAKE=../../qake
 
+# Budgets, with the native module built (see tests/budget.sh).
+# Make starts a few $(shell) calls of prologue.mk in a null build
+#   (one more right after a build: see durations.awk), and no recipes.
+# Touching 'a' without changing it hashes it again, and runs no commands.
+NULL_BUILD_PROCESSES=5
+NULL_BUILD_HASHED_FILES=0
+NULL_BUILD_HASHED_BYTES=0
+MEANINGLESS_CHANGE_COMMANDS=0
+
 set -ex
 
-set_up () {
-    export RELAY_DEBUG=
-}
+. ../../tests/budget.sh
 
 case_full_build () {
     rm -rf build
@@ -18,7 +25,11 @@ case_full_build () {
 case_null_build () {
     rm -rf build
     $QAKE >/dev/null 2>&1
-    $QAKE | sort > log
+    measured_qake
+    sort output > log
+    check_budget processes $PROCESSES $NULL_BUILD_PROCESSES
+    check_budget "hashed files" $HASHED_FILES $NULL_BUILD_HASHED_FILES
+    check_budget "hashed bytes" $HASHED_BYTES $NULL_BUILD_HASHED_BYTES
     cat null_build.log | sort > null_build.log.sorted
     diff -q log null_build.log.sorted
 }
@@ -27,7 +38,10 @@ case_meaningless_change_build () {
     rm -rf build
     $QAKE >/dev/null 2>&1
     touch build/res/a
-    $QAKE | sort > log
+    measured_qake
+    sort output > log
+    check_budget commands $(grep -c '^[AB]$' output) \
+        $MEANINGLESS_CHANGE_COMMANDS
     cat meaningless_change_build.log | sort > meaningless_change_build.log.sorted
     diff -q log meaningless_change_build.log.sorted
 }
@@ -15,6 +15,12 @@ info() {
 verbose
 verbose
 
+# Test scripts count processes started by Make (see tests/budget.sh).
+if [ -n "$QAKE_STATS" ]
+then
+    echo started 1 >> "$QAKE_STATS"
+fi
+
 while [ $# -gt 0 ]
 do
     case $1 in
@@ -0,0 +1,150 @@
+#!/bin/sh
+
+# Explicit rules benchmark: how long does it take Make to build the graph
+#   of an up to date project, and how many files does it stat meanwhile,
+#   with pattern rules (default) and with explicit rules (EXPLICIT_RULES=y).
+#
+# Usage: ./explicit_rules.sh [NUMBER_OF_SOURCES...]
+#
+# For each number of sources, a throw-away project is generated in
+#   a temporary directory and built. There's a static library for each
+#   100 sources (all of them include one header), and a program linked
+#   with all the libraries. Then the null build is run in each mode:
+#   once to fill the rules cache, and then three times to be timed.
+# Nothing is rebuilt by the null build, so what's measured is reading
+#   of Makefiles and walking of the graph.
+# Make is run directly, not through qake, so that only Make is counted.
+# Calls of stat and friends are counted by a small preloaded library,
+#   which is compiled on the fly; it needs a C compiler and 'dlsym'.
+#
+# Building 50000 sources takes a while: run with smaller numbers first.
+
+QAKE_INCLUDE_DIR=$(cd $(dirname $0)/../.. && pwd)
+export QAKE_INCLUDE_DIR
+
+[ $# -eq 0 ] && set -- 1000 10000 50000
+
+# Current time in milliseconds.
+now() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Library counting stat calls of the process it's preloaded into.
+# Make may be linked against either the old (__xstat) or the new (stat)
+#   symbols of glibc, so both are counted.
+# It's removed from the environment right away: recipes aren't counted.
+build_counter () {
+    cat > $1.c <<'SOURCE'
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+static unsigned long count;
+static const char *output;
+
+#define COUNTED(name, type, ...)                                  \
+  int name (__VA_ARGS__)                                          \
+  {                                                               \
+    static int (*real) ();                                        \
+    if (!real)                                                    \
+      real = (int (*) ()) dlsym (RTLD_NEXT, #name);               \
+    count++;                                                      \
+    return real type;                                             \
+  }
+
+COUNTED (stat, (path, buf), const char *path, struct stat *buf)
+COUNTED (lstat, (path, buf), const char *path, struct stat *buf)
+COUNTED (fstat, (fd, buf), int fd, struct stat *buf)
+COUNTED (fstatat, (fd, path, buf, flags),
+         int fd, const char *path, struct stat *buf, int flags)
+COUNTED (__xstat, (ver, path, buf), int ver, const char *path, void *buf)
+COUNTED (__lxstat, (ver, path, buf), int ver, const char *path, void *buf)
+COUNTED (__fxstat, (ver, fd, buf), int ver, int fd, void *buf)
+COUNTED (__xstat64, (ver, path, buf), int ver, const char *path, void *buf)
+COUNTED (__lxstat64, (ver, path, buf), int ver, const char *path, void *buf)
+COUNTED (__fxstat64, (ver, fd, buf), int ver, int fd, void *buf)
+
+__attribute__ ((constructor)) static void
+start (void)
+{
+  output = getenv ("STAT_COUNT");
+  unsetenv ("LD_PRELOAD");
+}
+
+__attribute__ ((destructor)) static void
+finish (void)
+{
+  FILE *file = output ? fopen (output, "w") : NULL;
+  if (file)
+    {
+      fprintf (file, "%lu\n", count);
+      fclose (file);
+    }
+}
+SOURCE
+    ${CC:-cc} -shared -fPIC -O2 -o $1.so $1.c -ldl
+}
+
+generate_project () {
+    DIR=$1
+    N=$2
+    mkdir -p $DIR/src/main
+    echo "int common(void);" > $DIR/src/common.h
+    echo "int main(void) { return 0; }" > $DIR/src/main/main.c
+    i=0
+    while [ $i -lt $N ]
+    do
+        mkdir -p $DIR/src/d$((i / 100))
+        printf '#include "../common.h"\nint f%d(void) { return %d; }\n' \
+            $i $i > $DIR/src/d$((i / 100))/f$i.c
+        i=$((i + 1))
+    done
+    cat > $DIR/Makefile <<'MAKEFILE'
+THIS_MAKEFILE := $(lastword $(MAKEFILE_LIST))
+LIBRARIES := $(notdir $(wildcard src/d*))
+$(foreach LIBRARY,$(LIBRARIES),$(eval $(call STATIC_LIBRARY,$(LIBRARY),$(LIBRARY),$(wildcard src/$(LIBRARY)/*.c),,,,)))
+$(eval $(call PROGRAM,main,bench,src/main/main.c,,,,$(LIBRARIES)))
+MAKEFILE
+}
+
+COUNTER=$(mktemp -d)/count
+build_counter $COUNTER || exit 1
+
+# Null build: prints time in milliseconds and number of stat calls.
+# The time is the best of three runs: it's what the mode costs,
+#   not what else the machine was busy with.
+null_build () {
+    MAKE_ARGS="-f $QAKE_INCLUDE_DIR/prologue.mk -f Makefile"
+    MAKE_ARGS="$MAKE_ARGS -f $QAKE_INCLUDE_DIR/epilogue.mk $*"
+    make $MAKE_ARGS > /dev/null
+    BEST=
+    for RUN in 1 2 3
+    do
+        START=$(now)
+        LD_PRELOAD=$COUNTER.so STAT_COUNT=$COUNTER.txt \
+            make $MAKE_ARGS > /dev/null
+        END=$(now)
+        [ -z "$BEST" ] || [ $((END - START)) -lt $BEST ] \
+            && BEST=$((END - START))
+    done
+    echo $BEST $(cat $COUNTER.txt)
+}
+
+printf "%10s %12s %12s %12s %12s\n" \
+    sources "pattern ms" "stat calls" "explicit ms" "stat calls"
+for N in "$@"
+do
+    DIR=$(mktemp -d)
+    generate_project $DIR $N
+    cd $DIR
+    make -f $QAKE_INCLUDE_DIR/prologue.mk -f Makefile \
+         -f $QAKE_INCLUDE_DIR/epilogue.mk > /dev/null 2>&1
+    printf "%10s %12s %12s %12s %12s\n" $N \
+        $(null_build EXPLICIT_RULES=n) $(null_build EXPLICIT_RULES=y)
+    cd - > /dev/null
+    rm -rf $DIR
+done
+rm -rf $(dirname $COUNTER)
@@ -0,0 +1,99 @@
+"""Generate a synthetic project for qake benchmarks.
+
+Usage: python3 generate.py DIRECTORY [options]
+
+Sources are split between several programs, each built by its' own
+PROGRAM call, and spread over a tree of directories under
+src/<program>/. Each source includes a few of the shared headers
+from include/, so touching a header rebuilds a part of each program.
+Everything is deterministic: the same options give the same project.
+
+See scaling.sh, which builds these and times the usual kinds of builds.
+"""
+
+import argparse
+import os
+
+
+def parse_arguments():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[0])
+    parser.add_argument('directory')
+    parser.add_argument('--sources', type=int, default=1000,
+                        help='number of sources, all programs together')
+    parser.add_argument('--programs', type=int, default=4,
+                        help='number of programs')
+    parser.add_argument('--headers', type=int, default=100,
+                        help='number of shared headers')
+    parser.add_argument('--fan-out', type=int, default=5,
+                        help='number of headers each source includes')
+    parser.add_argument('--depth', type=int, default=2,
+                        help='depth of directory tree of each program')
+    parser.add_argument('--per-directory', type=int, default=50,
+                        help='number of sources in each leaf directory')
+    return parser.parse_args()
+
+
+def write(path, text):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    open(path, 'w').write(text)
+
+
+def leaf_directory(index, depth, per_directory):
+    """Leaf directory of the given source, relative to its' program."""
+    leaf = index // per_directory
+    parts = []
+    for _ in range(depth):
+        parts.append('d{0}'.format(leaf % 10))
+        leaf //= 10
+    # Directories left over by the digits above are put at the top.
+    if leaf:
+        parts[-1] += '_{0}'.format(leaf)
+    return '/'.join(reversed(parts))
+
+
+def generate(options):
+    root = options.directory
+    for h in range(options.headers):
+        write('{0}/include/h{1}.h'.format(root, h),
+              '#ifndef H{0}\n#define H{0}\n'
+              'int h{0}(int x);\n'
+              '#define H{0}_VALUE {0}\n'
+              '#endif\n'.format(h))
+
+    programs = ['p{0}'.format(p) for p in range(options.programs)]
+    for p, program in enumerate(programs):
+        count = (options.sources // options.programs
+                 + (p < options.sources % options.programs))
+        for i in range(count):
+            includes = ''.join(
+                '#include "h{0}.h"\n'.format(
+                    (i * options.fan_out + j) % options.headers)
+                for j in range(min(options.fan_out, options.headers)))
+            directory = leaf_directory(i, options.depth,
+                                       options.per_directory)
+            write('{0}/src/{1}/{2}/f{3}.c'.format(root, program,
+                                                  directory, i),
+                  includes
+                  + 'int {0}_f{1}(int x) {{ return x + {1}; }}\n'.format(
+                      program, i))
+        write('{0}/src/{1}/main.c'.format(root, program),
+              'int main(void) { return 0; }\n')
+
+    # Each level of the tree is one more '*/' in the wildcard.
+    levels = ['src/$(BENCH_PROGRAM)/' + '*/' * d + '*.c'
+              for d in range(options.depth + 1)]
+    write('{0}/Makefile'.format(root),
+          'THIS_MAKEFILE := $(lastword $(MAKEFILE_LIST))\n'
+          '\n'
+          'PROGRAMS := {0}\n'
+          '\n'
+          '$(foreach BENCH_PROGRAM,$(PROGRAMS),$(eval $(call PROGRAM,\\\n'
+          '  $(BENCH_PROGRAM),\\\n'
+          '  $(BENCH_PROGRAM),\\\n'
+          '  $(wildcard {1}),\\\n'
+          '  -Iinclude,,,)))\n'.format(' '.join(programs),
+                                       ' '.join(levels)))
+
+
+if __name__ == '__main__':
+    generate(parse_arguments())
@@ -0,0 +1,50 @@
+#!/bin/sh
+
+# Parse-time benchmark: how long does it take Make to read the Makefiles
+#   and expand PROGRAM, depending on the number of sources.
+#
+# Usage: ./parse_time.sh [NUMBER_OF_SOURCES...]
+#
+# For each number of sources, a throw-away project is generated in
+#   a temporary directory, and 'qake clean' is timed there.
+# 'clean' doesn't depend on anything, and there's nothing to remove yet,
+#   so what's measured is mostly reading of Makefiles.
+
+QAKE=$(cd $(dirname $0)/../.. && pwd)/qake
+export QAKE_INCLUDE_DIR=${QAKE_INCLUDE_DIR:-$(dirname $QAKE)}
+
+[ $# -eq 0 ] && set -- 10 100 1000 5000
+
+# Current time in milliseconds.
+now() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+generate_project () {
+    DIR=$1
+    N=$2
+    mkdir -p $DIR/src
+    i=0
+    while [ $i -lt $N ]
+    do
+        echo "int f$i(void) { return $i; }" > $DIR/src/f$i.c
+        i=$((i + 1))
+    done
+    cat > $DIR/Makefile <<'MAKEFILE'
+THIS_MAKEFILE := $(lastword $(MAKEFILE_LIST))
+SRC := $(wildcard src/*.c)
+$(eval $(call PROGRAM,,bench,$(SRC),,,))
+MAKEFILE
+}
+
+printf "%10s %10s\n" sources ms
+for N in "$@"
+do
+    DIR=$(mktemp -d)
+    generate_project $DIR $N
+    START=$(now)
+    (cd $DIR && $QAKE clean > /dev/null)
+    END=$(now)
+    printf "%10s %10s\n" $N $((END - START))
+    rm -rf $DIR
+done
@@ -0,0 +1,84 @@
+#!/bin/sh
+
+# Build-scaling benchmark: how do the usual kinds of builds behave
+#   as the project grows.
+#
+# Usage: ./scaling.sh [NUMBER_OF_SOURCES...]
+#
+# For each number of sources, a throw-away project is generated
+#   by generate.py in a temporary directory; options of the generator
+#   may be passed in GENERATE, like this:
+# GENERATE='--programs 8 --fan-out 20' ./scaling.sh 10000
+# Arguments of qake (say, EXPLICIT_RULES=y) may be passed in QAKE_ARGS.
+#
+# These builds are run one after another, each on the result
+#   of the previous one:
+#   full      - from scratch;
+#   null      - nothing changed;
+#   touch     - one source got a new function;
+#   header    - one header got a new declaration: sources including it
+#               are recompiled, but nothing is relinked;
+#   comment   - one source got a comment: it's recompiled, nothing else;
+#   makefile  - Makefile got a comment: build commands are generated
+#               again, but they're the same, so nothing is rebuilt.
+# For each build, there's wall time, the number of processes started
+#   meanwhile, and the number of files in build/aux afterwards.
+# Processes are counted by the system-wide counter in /proc/stat, so
+#   whatever else runs on the machine is counted too: keep it quiet.
+
+BENCH_DIR=$(cd $(dirname $0) && pwd)
+QAKE=$(cd $BENCH_DIR/../.. && pwd)/qake
+export QAKE_INCLUDE_DIR=${QAKE_INCLUDE_DIR:-$(dirname $QAKE)}
+
+[ $# -eq 0 ] && set -- 1000 10000
+
+# Current time in milliseconds.
+now() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+# Number of processes started since boot.
+processes() {
+    awk '$1 == "processes" { print $2 }' /proc/stat
+}
+
+# Runs the build and prints a line of the report.
+measure () {
+    CASE=$1
+    PROCESSES=$(processes)
+    START=$(now)
+    $QAKE $QAKE_ARGS > /dev/null 2>&1 || echo "$CASE build failed" >&2
+    END=$(now)
+    # Three processes are this script's own: two of date and awk.
+    printf "%10s %10s %10s %12s %10s\n" $N $CASE $((END - START)) \
+        $(($(processes) - PROCESSES - 3)) \
+        $(find build/aux -type f | wc -l)
+}
+
+printf "%10s %10s %10s %12s %10s\n" \
+    sources build ms processes "aux files"
+for N in "$@"
+do
+    DIR=$(mktemp -d)
+    python3 $BENCH_DIR/generate.py $DIR --sources $N $GENERATE || exit 1
+    cd $DIR
+
+    measure full
+    measure null
+
+    SOURCE=$(find src -name f1.c | head -n 1)
+    echo "int touched(void) { return 1; }" >> $SOURCE
+    measure touch
+
+    echo "int header_touched(void);" >> include/h1.h
+    measure header
+
+    echo "/* Comment. */" >> $SOURCE
+    measure comment
+
+    echo "# Comment." >> Makefile
+    measure makefile
+
+    cd - > /dev/null
+    rm -rf $DIR
+done
@@ -0,0 +1,38 @@
+# Measuring builds against budgets, for test scripts.
+# Sourced by tests/circle/test.sh and proto/cmd/test.sh, which set QAKE
+#   and run in their' own directories.
+
+set_up () {
+    export RELAY_DEBUG=
+    export QAKE_STATS=$(pwd)/stats
+}
+
+# Run qake with output going to 'output', and measure the build:
+#   PROCESSES is how many processes Make started, recipes and $(shell)
+#   calls (see QAKE_STATS in native/relay.c), not counting what they
+#   started in turn. HASHED_FILES and HASHED_BYTES are how many files
+#   were hashed by Make and how much was read for that (see QAKE_STATS
+#   in native/qake.c; without the native module, hashing is done
+#   by processes).
+measured_qake () {
+    rm -f stats
+    $QAKE "$@" > output
+    PROCESSES=0
+    HASHED_FILES=0
+    HASHED_BYTES=0
+    if [ -f stats ]
+    then
+        PROCESSES=$(awk '$1 == "started" { n += $2 } END { print n + 0 }' stats)
+        HASHED_FILES=$(awk '$1 == "hashed" { n += $2 } END { print n + 0 }' stats)
+        HASHED_BYTES=$(awk '$1 == "hashed" { n += $3 } END { print n + 0 }' stats)
+    fi
+}
+
+# Fail if $2 (the measured $1) is over the budget $3.
+check_budget () {
+    if [ $2 -gt $3 ]
+    then
+        echo "Over budget: $1 is $2, at most $3 expected" >&2
+        return 1
+    fi
+}
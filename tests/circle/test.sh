@@ -2,15 +2,24 @@
 
 QAKE=../../qake
 
+# Budgets, with the native module built (see tests/budget.sh).
+# Make starts a few $(shell) calls of prologue.mk in a null build
+#   (one more right after a build: see durations.awk), and no recipes.
+# Make hashes the Makefiles, as the key of the rules cache, and nothing else.
+# A comment added to one source compiles it, and links nothing.
+NULL_BUILD_PROCESSES=5
+NULL_BUILD_HASHED_FILES=2
+NULL_BUILD_HASHED_BYTES=131072
+MEANINGLESS_CHANGE_COMPILES=1
+
 set -ex
 
-set_up () {
-    export RELAY_DEBUG=
-}
+. ../../tests/budget.sh
 
+# Warnings of the compiler vary with its' version: stderr isn't compared.
 case_full_build () {
     rm -rf build
-    $QAKE 2>&1 | sort > log
+    $QAKE 2>/dev/null | sort > log
     cat full_build.log | sort > full_build.log.sorted
     diff -q log full_build.log.sorted
 }
@@ -18,7 +27,11 @@ case_full_build () {
 case_null_build () {
     rm -rf build
     $QAKE >/dev/null 2>&1
-    $QAKE | sort > log
+    measured_qake
+    sort output > log
+    check_budget processes $PROCESSES $NULL_BUILD_PROCESSES
+    check_budget "hashed files" $HASHED_FILES $NULL_BUILD_HASHED_FILES
+    check_budget "hashed bytes" $HASHED_BYTES $NULL_BUILD_HASHED_BYTES
     cat null_build.log | sort > null_build.log.sorted
     diff -q log null_build.log.sorted
 }
@@ -27,7 +40,10 @@ case_meaningless_change_build () {
     rm -rf build
     $QAKE >/dev/null 2>&1
     echo // >> src/irc.c
-    $QAKE | sort > log
+    measured_qake
+    sort output > log
+    check_budget compiles $(grep -c '^GCC ' output) \
+        $MEANINGLESS_CHANGE_COMPILES
     cat meaningless_change_build.log | sort > meaningless_change_build.log.sorted
     diff -q log meaningless_change_build.log.sorted
 
@@ -56,6 +72,156 @@ case_command_change_build () {
     diff -q log command_change_build.log.sorted
 }
 
+# A source edited and checked out again leaves its' unit and comes back:
+#   the unit is compiled on the way back, and not again after that.
+case_unity_return_build () {
+    rm -rf build
+    QAKE_UNITY="$QAKE UNITY=y UNITY_UNITS=2"
+    $QAKE_UNITY >/dev/null 2>&1
+    echo 'void test(void) { printf ("Test\\n"); }' >> src/irc.c
+    $QAKE_UNITY >/dev/null 2>&1
+    git checkout src/irc.c
+    $QAKE_UNITY > log 2>/dev/null
+    grep -q '^GCC unity-' log
+    $QAKE_UNITY > log 2>&1
+    test ! -s log
+}
+
+# The critical path is read from the timeline of the last build, which
+#   stays in place, and the cached rules aren't expanded again for it.
+case_critical_path () {
+    rm -rf build
+    $QAKE >/dev/null 2>&1
+    cp build/aux/trace.json trace.json.last
+    touch -d '1 minute ago' build/aux/generated/*
+    touch stamp
+    $QAKE --critical-path > output
+    grep -q '^Critical path: ' output
+    cmp build/aux/trace.json trace.json.last
+    $QAKE >/dev/null
+    test -z "$(find build/aux/generated -newer stamp)"
+    rm trace.json.last stamp
+}
+
+# An object compiled by the pool is the one compiled here. The pool keeps
+#   the input and the object, once each however many times they're sent,
+#   and the store stays under its' size, here a megabyte. A compiler not
+#   allowed is refused, and the compile is run here; so it is without
+#   the socket.
+case_worker_build () {
+    OUT=$(mktemp -d)
+    WORKER=../../native/qake-worker
+    CFLAGS="-O2 -Isrc -c src/irc.c"
+    $WORKER --serve $OUT/worker.sock $OUT/store --jobs 2 --store-size 1 \
+        --compiler gcc
+    gcc $CFLAGS -o $OUT/local.o
+    $WORKER --compile $OUT/worker.sock -- gcc $CFLAGS -o $OUT/pool.o
+    cmp $OUT/local.o $OUT/pool.o
+    test $(ls $OUT/store/pool.* | wc -l) -eq 2
+    $WORKER --compile $OUT/worker.sock -- gcc $CFLAGS -o $OUT/pool.o
+    cmp $OUT/local.o $OUT/pool.o
+    test $(ls $OUT/store/pool.* | wc -l) -eq 2
+    $WORKER --compile $OUT/worker.sock -- cc $CFLAGS -o $OUT/refused.o \
+        2> $OUT/errors
+    grep -q '^qake-worker: cc: not an allowed compiler$' $OUT/errors
+    test -f $OUT/refused.o
+    for SOURCE in src/*.c
+    do
+        $WORKER --compile $OUT/worker.sock -- gcc -O2 -Isrc -c $SOURCE \
+            -o $OUT/object.o 2>/dev/null
+    done
+    test $(cat $OUT/store/pool.*/* | wc -c) -le 1048576
+    test $(ls $OUT/store/pool.* | wc -l) -gt 0
+    rm $OUT/worker.sock
+    $WORKER --compile $OUT/worker.sock -- gcc $CFLAGS -o $OUT/fallback.o
+    cmp $OUT/local.o $OUT/fallback.o
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        test -n "$(ls $OUT/store)" || break
+        sleep 0.5
+    done
+    test -z "$(ls $OUT/store)"
+    rm -rf $OUT
+}
+
+# The daemon answers a null build itself: Make isn't started. A touched
+#   source is still clean: a command of our own tells if it's run.
+#   An edited one is dirty, and qake prints its' object before building.
+#   Removing the build directory stops the daemon.
+# What the test writes goes out of the project, or the daemon would see it.
+case_daemon_build () {
+    rm -rf build
+    OUT=$(mktemp -d)
+    WATCH_BUILD="../../native/qake-watch --build build/aux/watch.sock Makefile --"
+    ANSWER="touch $OUT/answer; exit 1"
+    $QAKE >/dev/null 2>&1
+    $QAKE --daemon
+    QAKE_STATS=$OUT/stats $QAKE >/dev/null 2>&1
+    rm $OUT/stats
+    QAKE_STATS=$OUT/stats $QAKE > $OUT/output
+    test ! -s $OUT/output
+    test ! -f $OUT/stats
+    touch src/irc.c
+    $WATCH_BUILD sh -c "$ANSWER"
+    test ! -f $OUT/answer
+    echo '// x' >> src/irc.c
+    $QAKE > /dev/null 2> $OUT/errors
+    grep -qx 'DIRTY build/res/circled/irc.c.o' $OUT/errors
+    git checkout src/irc.c
+    rm -rf build $OUT
+    for i in 1 2 3 4 5 6 7 8 9 10
+    do
+        pgrep -f 'qake-watch --serve build/aux/watch.sock' >/dev/null || return 0
+        sleep 0.5
+    done
+    return 1
+}
+
+# A precompiled header is built with the program. A comment added to it
+#   leaves the .gch as it was, and compiles nothing, as long as comments
+#   of headers don't count: sources include the header themselves too.
+#   A macro recompiles every object. A copy of the project precompiles
+#   its' own header.
+case_precompiled_header_build () {
+    rm -rf build
+    sed 's|^))$|,src/circle.h))|' Makefile > Makefile.tmp
+    PCH_QAKE="$QAKE -f Makefile.tmp IGNORE_HEADER_COMMENTS=y"
+    $PCH_QAKE > log 2>/dev/null
+    grep -q '^GCC circle.h.gch$' log
+    cp build/res/circled/circle.h.gch circle.h.gch.last
+    echo '/* x */' >> src/circle.h
+    $PCH_QAKE > log 2>/dev/null
+    test ! -s log
+    cmp build/res/circled/circle.h.gch circle.h.gch.last
+    echo '#define CIRCLE_PRECOMPILED 1' >> src/circle.h
+    $PCH_QAKE > log 2>/dev/null
+    grep -q '^GCC circle.h.gch$' log
+    test $(grep -c '^GCC .*\.c\.o$' log) -eq $(ls src/*.c | wc -l)
+    OUT=$(mktemp -d)
+    cp -a . $OUT
+    git checkout src/circle.h
+    QAKE_PATH=$(cd $(dirname $QAKE) && pwd)/$(basename $QAKE)
+    (cd $OUT && $QAKE_PATH -f Makefile.tmp IGNORE_HEADER_COMMENTS=y >/dev/null 2>&1)
+    grep -q "$OUT/src/circle.h" $OUT/build/res/circled/circle.h
+    rm -rf build $OUT Makefile.tmp circle.h.gch.last
+}
+
+# A heavy link takes 4 job slots, and its' objects still take one.
+# The weights are logged by a gcc of our own, first in PATH.
+case_heavy_link_build () {
+    rm -rf build bin weights
+    cp Makefile Makefile.tmp
+    echo '$(eval $(call HEAVY,circled/circled,4))' >> Makefile.tmp
+    mkdir bin
+    printf '#!/bin/sh\necho "$QAKE_JOB_WEIGHT $*" >> %s/weights\nexec %s "$@"\n' \
+        "$(pwd)" "$(command -v gcc)" > bin/gcc
+    chmod +x bin/gcc
+    PATH=$(pwd)/bin:$PATH $QAKE -f Makefile.tmp >/dev/null 2>&1
+    test $(grep -c ' -c ' weights) -eq $(ls src/*.c | wc -l)
+    test $(grep ' -c ' weights | grep -vc '^1 ') -eq 0
+    grep -q '^4 .*-o build/res/circled/circled ' weights
+    rm -rf bin weights Makefile.tmp
+}
 
 set_up
 case_full_build
@@ -63,3 +229,9 @@ case_null_build
 case_meaningless_change_build
 case_meaningful_change_build
 case_command_change_build
+case_unity_return_build
+case_precompiled_header_build
+case_heavy_link_build
+case_critical_path
+case_worker_build
+case_daemon_build
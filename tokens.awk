@@ -0,0 +1,143 @@
+# Reduce preprocessor output to the stream of tokens it consists of.
+#
+# Usage: gcc -E -P ... | awk -f tokens.awk
+#
+# This is what cache.sh uses for fingerprints of sources:
+#   two sources giving the same output here compile to the same object
+#   (unless debugging info is requested, see cache.sh).
+# Comments are already stripped by the preprocessor, and -P drops
+#   line markers. What's left is layout, and that's what we throw away:
+#   - every run of whitespace, including line breaks, becomes one space;
+#   - the space is dropped altogether, unless characters on both sides
+#     of it could be a part of one token: 'a + 1' becomes 'a+1',
+#     but 'a+ +b' doesn't become 'a++b', which is a different program.
+# That's decided by the pair of characters only, so some spaces are kept
+#   where they aren't needed ('> >' in templates, for one).
+# It doesn't matter much: we only lose some pruning.
+#
+# Contents of character and string literals are copied as is,
+#   C++ raw strings included. Anything we can't parse (an unterminated
+#   literal, for one) is copied as is too - that can only make two
+#   fingerprints differ, never make them the same.
+#
+# Lines starting with '#' are directives left by the preprocessor
+#   (#pragma, and #define with -dD). They are line-oriented,
+#   so they are kept on lines of their own.
+
+BEGIN {
+    # Pairs of characters starting punctuators longer than one character.
+    PUNCTUATORS = " ++ -- -> >* += -= *= /= %= &= |= ^= << >> <= >= => == != " \
+                  "&& || :: ## <: :> <% %> %: :% .* // /* "
+    # Last character written, and whether there was whitespace after it.
+    LAST = ""
+    PENDING = 0
+    # Terminator of C++ raw string we're in, if any.
+    RAW_END = ""
+}
+
+# Whether a space between characters 'a' and 'b' may separate tokens.
+function joinable(a, b) {
+    # Identifiers, numbers, encoding prefixes and suffixes of literals.
+    if (a ~ /[A-Za-z0-9_.'"]/ && b ~ /[A-Za-z0-9_.'"]/)
+        return 1
+    # Exponent of a number: 1e+5.
+    if (a ~ /[eEpP]/ && b ~ /[-+]/)
+        return 1
+    return index(PUNCTUATORS, " " a b " ") > 0
+}
+
+# Write a chunk with no whitespace in it (or a literal),
+#   preceded by a space if needed.
+function emit(chunk) {
+    if (chunk == "")
+        return
+    if (PENDING && LAST != "" && joinable(LAST, substr(chunk, 1, 1)))
+        printf " "
+    printf "%s", chunk
+    LAST = substr(chunk, length(chunk), 1)
+    PENDING = 0
+}
+
+# Write a piece of code with no literals in it.
+function emit_code(code,    n, i, words) {
+    n = split(code, words, /[ \t\r\f\v]+/)
+    for (i = 1; i <= n; i++) {
+        if (i > 1)
+            PENDING = 1
+        emit(words[i])
+    }
+}
+
+# Copy the line as is until terminator of the raw string.
+# Returns the rest of the line after it, or "" with RAW_END still set.
+function emit_raw(line,    end) {
+    end = index(line, RAW_END)
+    if (end == 0) {
+        printf "%s\n", line
+        return ""
+    }
+    printf "%s", substr(line, 1, end + length(RAW_END) - 1)
+    LAST = "\""
+    PENDING = 0
+    line = substr(line, end + length(RAW_END))
+    RAW_END = ""
+    return line
+}
+
+RAW_END != "" {
+    $0 = emit_raw($0)
+    if (RAW_END != "")
+        next
+}
+
+/^[ \t]*#/ {
+    if (LAST != "")
+        printf "\n"
+    print
+    LAST = ""
+    PENDING = 0
+    next
+}
+
+{
+    line = $0
+    while (match(line, /["']/)) {
+        code = substr(line, 1, RSTART - 1)
+        line = substr(line, RSTART)
+        emit_code(code)
+
+        # R"delimiter( ... )delimiter", possibly with encoding prefix.
+        if (substr(line, 1, 1) == "\"" \
+            && match(code, /(^|[^A-Za-z0-9_])(u8|u|U|L)?R$/) \
+            && match(line, /^"[^ ()\\\t]*\(/)) {
+            RAW_END = ")" substr(line, 2, RLENGTH - 2) "\""
+            printf "%s", substr(line, 1, RLENGTH)
+            line = emit_raw(substr(line, RLENGTH + 1))
+            if (RAW_END != "")
+                break
+            continue
+        }
+
+        if (substr(line, 1, 1) == "\"")
+            found = match(line, /^"([^"\\]|\\.)*"/)
+        else
+            found = match(line, /^'([^'\\]|\\.)*'/)
+        if (!found) {
+            # Not a literal we understand: keep the rest as is.
+            emit(line)
+            line = ""
+            break
+        }
+        emit(substr(line, 1, RLENGTH))
+        line = substr(line, RLENGTH + 1)
+    }
+    if (RAW_END == "") {
+        emit_code(line)
+        PENDING = 1
+    }
+}
+
+END {
+    if (LAST != "")
+        printf "\n"
+}
@@ -0,0 +1,124 @@
+# Split sources of a program between unity translation units.
+#
+# Usage: xargs wc -c < SOURCES \
+#        | awk -f unity.awk -v NAME=... -v UNITS=... \
+#              -v SOURCE_PREFIX=... -v OBJECT_PREFIX=... \
+#              [HISTORY] [PARTITION] - > NEW_PARTITION
+#
+# prologue.mk runs this when sources of a program built with UNITY=y
+#   aren't the ones split the last time (see UNITY_OBJECTS there).
+# The partition is a Makefile, one unit per line:
+#   UNITY_circled_NUMBERS := 1 2
+#   UNITY_circled_1 := src/irc.c src/main.c
+#   UNITY_circled_2 := src/ircq.c src/ircenv.c
+#
+# Each source weighs as long as its' object took to compile, according
+#   to the history of durations (see durations.awk). Sources not compiled
+#   yet weigh their' size, converted to microseconds at the rate of the
+#   ones that were: the rate is all we know about them.
+# The heaviest sources are placed first, each into the lightest unit,
+#   so units take about the same time to compile.
+#
+# A unit changes, and is compiled again, whenever a source is added to or
+#   removed from it. So if the previous partition had the same units,
+#   sources keep their' units, and only the new ones are placed.
+
+# Durations recorded before: us:655000 build/res/circled/ircq.c.o
+/^us:[0-9]+ / {
+    DURATION[$2] = substr($1, 4) + 0
+    next
+}
+
+# The previous partition.
+$1 == "UNITY_" NAME "_NUMBERS" {
+    PREVIOUS_UNITS = $0
+    sub(/^[^=]*= */, "", PREVIOUS_UNITS)
+    next
+}
+
+index($1, "UNITY_" NAME "_") == 1 && $2 == ":=" {
+    unit = substr($1, length("UNITY_" NAME "_") + 1)
+    for (i = 3; i <= NF; i++)
+        PREVIOUS[$i] = unit
+    next
+}
+
+# Sizes of the sources, as 'wc -c' lists them.
+FILENAME == "-" && NF == 2 && $2 != "total" {
+    SOURCES[++COUNT] = $2
+    SIZE[$2] = $1 + 0
+    object = OBJECT_PREFIX substr($2, length(SOURCE_PREFIX) + 1) ".o"
+    if (object in DURATION) {
+        WEIGHT[$2] = DURATION[object]
+        KNOWN_US += DURATION[object]
+        KNOWN_BYTES += $1
+    }
+}
+
+END {
+    RATE = KNOWN_BYTES ? KNOWN_US / KNOWN_BYTES : 1
+    N = split(UNITS, NUMBERS, " ")
+    KEEP = PREVIOUS_UNITS == UNITS
+
+    # Unplaced sources, heaviest first; ties go by name, so the same
+    #   sources are always split the same way.
+    for (i = 1; i <= COUNT; i++) {
+        source = SOURCES[i]
+        if (!(source in WEIGHT))
+            WEIGHT[source] = SIZE[source] * RATE
+        if (KEEP && source in PREVIOUS) {
+            UNIT[source] = PREVIOUS[source]
+            LOAD[PREVIOUS[source]] += WEIGHT[source]
+        } else
+            PENDING[++P] = source
+    }
+    sort_pending()
+
+    for (i = 1; i <= P; i++) {
+        lightest = NUMBERS[1]
+        for (k = 2; k <= N; k++)
+            if (LOAD[NUMBERS[k]] < LOAD[lightest])
+                lightest = NUMBERS[k]
+        UNIT[PENDING[i]] = lightest
+        LOAD[lightest] += WEIGHT[PENDING[i]]
+    }
+
+    print "UNITY_" NAME "_NUMBERS := " UNITS
+    for (k = 1; k <= N; k++) {
+        line = "UNITY_" NAME "_" NUMBERS[k] " :="
+        for (i = 1; i <= COUNT; i++)
+            if (UNIT[SOURCES[i]] == NUMBERS[k])
+                line = line " " SOURCES[i]
+        print line
+    }
+}
+
+function heavier(a, b) {
+    return WEIGHT[a] > WEIGHT[b] || (WEIGHT[a] == WEIGHT[b] && a < b)
+}
+
+# Heapsort of PENDING, heaviest first: there may be thousands of them.
+# The root of the heap is the one to go last.
+function sort_pending(    i, t) {
+    for (i = int(P / 2); i >= 1; i--)
+        sift(i, P)
+    for (i = P; i > 1; i--) {
+        t = PENDING[1]
+        PENDING[1] = PENDING[i]
+        PENDING[i] = t
+        sift(1, i - 1)
+    }
+}
+
+function sift(i, n,    child, t) {
+    while ((child = 2 * i) <= n) {
+        if (child < n && heavier(PENDING[child], PENDING[child + 1]))
+            child++
+        if (!heavier(PENDING[i], PENDING[child]))
+            return
+        t = PENDING[i]
+        PENDING[i] = PENDING[child]
+        PENDING[child] = t
+        i = child
+    }
+}